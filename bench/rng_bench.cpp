@@ -0,0 +1,439 @@
+/*
+	Microbenchmarks of the public rng.h entry points.
+
+	Every benchmark runs on one private RNG per thread, for each requested state size and thread count, and
+	reports one JSON record per run on stdout. The Random* benchmarks first write a new value into the top
+	slot of the stack, as the loop in the README does, so that every call pays for a full state hash rather
+	than a read of the digest cache; "Randomu64Cached" measures the cached read on its own. std::mt19937_64
+	and xoshiro256** are measured the same way as a baseline.
+
+	Build (see the README):
+		cc -std=c11 -O2 -c src/rng.c -o rng.o
+		c++ -std=c++11 -O2 bench/rng_bench.cpp rng.o -o rng_bench -lpthread
+
+	Usage: rng_bench [--sizes 32,64,...] [--threads 1,2,...] [--min-time ms] [--filter substring]
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../inc/rng.h"
+
+namespace
+{
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+// state of one thread of one run
+struct bench_ctx_t
+{
+	rng_t		rng;
+	uint64_t	sink;		// folded into g_sink at the end, so no result can be optimised away
+};
+
+typedef void (*bench_fn_t)(bench_ctx_t *ctx, uint64_t iterations);
+
+struct bench_t
+{
+	const char	*name;
+	bench_fn_t	run;
+	bool		sized;		// depends on the state size; unsized benchmarks only run at the first size
+	bool		slot;		// needs a 64-bit slot on the user stack, so cannot run on a bare 32-byte state
+};
+
+struct bench_result_t
+{
+	uint64_t	ops;
+	double		seconds;
+};
+
+std::atomic<uint64_t> g_sink(0);
+
+// xoshiro256** 1.0 by David Blackman and Sebastiano Vigna, public domain
+struct xoshiro256_t
+{
+	uint64_t	s[4];
+
+	explicit xoshiro256_t(uint64_t seed)
+	{
+		// SplitMix64 expansion of the seed, as recommended by the authors
+		for (int i = 0; i < 4; i++)
+		{
+			uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			s[i] = z ^ (z >> 31);
+		}
+	}
+	static inline uint64_t Rotl(uint64_t x, int k)
+	{
+		return (x << k) | (x >> (64 - k));
+	}
+	inline uint64_t Next()
+	{
+		const uint64_t result = Rotl(s[1] * 5, 7) * 9;
+		const uint64_t t = s[1] << 17;
+
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = Rotl(s[3], 45);
+
+		return result;
+	}
+};
+
+/* RNG lifetime */
+
+void Bench_New(bench_ctx_t *ctx, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+	{
+		rng_t rng = RNG_New();
+		ctx->sink += rng.state_size;
+		RNG_Destroy(&rng);
+	}
+}
+void Bench_Clone(bench_ctx_t *ctx, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+	{
+		rng_t rng = RNG_Clone(&ctx->rng);
+		ctx->sink += rng.state_size;
+		RNG_Destroy(&rng);
+	}
+}
+// a clone that is written to, which pays for the copy-on-write of a heap state
+void Bench_CloneWrite(bench_ctx_t *ctx, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+	{
+		rng_t rng = RNG_Clone(&ctx->rng);
+		ctx->sink += RNG_Pushu8(&rng, (uint8_t)i);
+		RNG_Destroy(&rng);
+	}
+}
+
+/* stack operations */
+
+void Bench_PushPopu64(bench_ctx_t *ctx, uint64_t n)
+{
+	uint64_t x;
+
+	for (uint64_t i = 0; i < n; i++)
+	{
+		RNG_Pushu64(&ctx->rng, i);
+		RNG_Popu64(&ctx->rng, &x);
+		ctx->sink += x;
+	}
+}
+void Bench_PushPopu8(bench_ctx_t *ctx, uint64_t n)
+{
+	uint8_t x;
+
+	for (uint64_t i = 0; i < n; i++)
+	{
+		RNG_Pushu8(&ctx->rng, (uint8_t)i);
+		RNG_Popu8(&ctx->rng, &x);
+		ctx->sink += x;
+	}
+}
+void Bench_SetRelativeu64(bench_ctx_t *ctx, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+		ctx->sink += RNG_SetRelativeu64(&ctx->rng, 1, i);
+}
+void Bench_GetRelativeu64(bench_ctx_t *ctx, uint64_t n)
+{
+	uint64_t x;
+
+	for (uint64_t i = 0; i < n; i++)
+	{
+		RNG_GetRelativeu64(&ctx->rng, 1, &x);
+		ctx->sink += x;
+	}
+}
+void Bench_SetIDu64(bench_ctx_t *ctx, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+		ctx->sink += RNG_SetIDu64(&ctx->rng, i);
+}
+void Bench_SetIDString(bench_ctx_t *ctx, uint64_t n)
+{
+	char id[] = "benchmark-id-000";
+
+	for (uint64_t i = 0; i < n; i++)
+	{
+		id[sizeof(id) - 2] = (char)('0' + (i & 7));
+		ctx->sink += RNG_SetIDString(&ctx->rng, id);
+	}
+}
+void Bench_SetIDStringHash(bench_ctx_t *ctx, uint64_t n)
+{
+	char id[] = "benchmark-id-000";
+
+	for (uint64_t i = 0; i < n; i++)
+	{
+		id[sizeof(id) - 2] = (char)('0' + (i & 7));
+		ctx->sink += RNG_SetIDStringHash(&ctx->rng, id);
+	}
+}
+
+/* outputs: the top slot changes before every call, so each call hashes the state */
+
+#define BENCH_RANDOM(fn)	void Bench_##fn(bench_ctx_t *ctx, uint64_t n)\
+{\
+	for (uint64_t i = 0; i < n; i++)\
+	{\
+		RNG_SetRelativeu64(&ctx->rng, 1, i);\
+		ctx->sink += (uint64_t)fn(&ctx->rng);\
+	}\
+}
+
+BENCH_RANDOM(RNG_Randomu64)
+BENCH_RANDOM(RNG_Randomu32)
+BENCH_RANDOM(RNG_Randomu16)
+BENCH_RANDOM(RNG_Randomu8)
+BENCH_RANDOM(RNG_Randomi64)
+BENCH_RANDOM(RNG_Randomi32)
+BENCH_RANDOM(RNG_Randomi16)
+BENCH_RANDOM(RNG_Randomi8)
+BENCH_RANDOM(RNG_Randomf32)
+BENCH_RANDOM(RNG_Randomf64)
+
+void Bench_Randomu64Cached(bench_ctx_t *ctx, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+		ctx->sink += RNG_Randomu64(&ctx->rng);
+}
+
+/* baselines */
+
+void Bench_MT19937_64(bench_ctx_t *ctx, uint64_t n)
+{
+	static thread_local std::mt19937_64 mt(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+	for (uint64_t i = 0; i < n; i++)
+		ctx->sink += mt();
+}
+void Bench_Xoshiro256(bench_ctx_t *ctx, uint64_t n)
+{
+	static thread_local xoshiro256_t xs(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+	for (uint64_t i = 0; i < n; i++)
+		ctx->sink += xs.Next();
+}
+
+const bench_t g_benchmarks[] =
+{
+	{"New",					Bench_New,					false,	false},
+	{"Clone",				Bench_Clone,				true,	false},
+	{"CloneWrite",			Bench_CloneWrite,			true,	false},
+	{"PushPopu64",			Bench_PushPopu64,			true,	false},
+	{"PushPopu8",			Bench_PushPopu8,			true,	false},
+	{"SetRelativeu64",		Bench_SetRelativeu64,		true,	true},
+	{"GetRelativeu64",		Bench_GetRelativeu64,		true,	true},
+	{"SetIDu64",			Bench_SetIDu64,				true,	false},
+	{"SetIDString",			Bench_SetIDString,			true,	false},
+	{"SetIDStringHash",		Bench_SetIDStringHash,		true,	false},
+	{"Randomu64",			Bench_RNG_Randomu64,		true,	true},
+	{"Randomu32",			Bench_RNG_Randomu32,		true,	true},
+	{"Randomu16",			Bench_RNG_Randomu16,		true,	true},
+	{"Randomu8",			Bench_RNG_Randomu8,			true,	true},
+	{"Randomi64",			Bench_RNG_Randomi64,		true,	true},
+	{"Randomi32",			Bench_RNG_Randomi32,		true,	true},
+	{"Randomi16",			Bench_RNG_Randomi16,		true,	true},
+	{"Randomi8",			Bench_RNG_Randomi8,			true,	true},
+	{"Randomf32",			Bench_RNG_Randomf32,		true,	true},
+	{"Randomf64",			Bench_RNG_Randomf64,		true,	true},
+	{"Randomu64Cached",		Bench_Randomu64Cached,		true,	false},
+	{"mt19937_64",			Bench_MT19937_64,			false,	false},
+	{"xoshiro256**",		Bench_Xoshiro256,			false,	false}
+};
+
+// An RNG whose state is "size" bytes, 32 of which are the counter, the rest user data.
+bool Bench_MakeRNG(rng_t *rng, uint32_t size)
+{
+	*rng = RNG_New();
+	if (!RNG_IsValid(rng) || RNG_SetTotalMaxStackSize(rng, size * 2) || RNG_SetUserMaxStackSize(rng, size * 2))
+		return false;
+
+	for (uint32_t i = RNG_GetTotalStackDepth(rng); i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+	{
+		if (RNG_Pushu64(rng, i))
+			return false;
+	}
+	while (RNG_GetTotalStackDepth(rng) < size)
+	{
+		if (RNG_Pushu8(rng, 0))
+			return false;
+	}
+
+	return true;
+}
+
+// Runs the benchmark in doubling batches until "min_time" has passed.
+bench_result_t Bench_Measure(const bench_t &bench, bench_ctx_t *ctx, double min_time)
+{
+	bench_result_t result = {0, 0.0};
+	uint64_t batch = 1;
+	bench_clock_t::time_point start = bench_clock_t::now();
+
+	do
+	{
+		bench.run(ctx, batch);
+		result.ops += batch;
+		result.seconds = std::chrono::duration<double>(bench_clock_t::now() - start).count();
+		if (batch < (1u << 20))
+			batch <<= 1;
+	} while (result.seconds < min_time);
+
+	return result;
+}
+
+// One run of a benchmark on "threads" threads, each with its own RNG, started together.
+bool Bench_Run(const bench_t &bench, uint32_t size, uint32_t threads, double min_time, bench_result_t *total, double *wall)
+{
+	std::vector<bench_result_t> results(threads);
+	std::vector<std::thread> pool;
+	std::atomic<uint32_t> ready(0);
+	std::atomic<bool> failed(false);
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		pool.push_back(std::thread([&, t]()
+		{
+			bench_ctx_t ctx;
+
+			ctx.sink = 0;
+			if (!Bench_MakeRNG(&ctx.rng, size))
+				failed = true;
+
+			ready++;
+			while (ready.load() < threads)
+				std::this_thread::yield();
+
+			if (!failed)
+				results[t] = Bench_Measure(bench, &ctx, min_time);
+			g_sink += ctx.sink;
+			RNG_Destroy(&ctx.rng);
+		}));
+	}
+	for (std::thread &th : pool)
+		th.join();
+
+	if (failed)
+		return false;
+
+	total->ops = 0;
+	total->seconds = 0.0;
+	*wall = 0.0;
+	for (const bench_result_t &r : results)
+	{
+		total->ops += r.ops;
+		total->seconds += r.seconds;
+		if (r.seconds > *wall)
+			*wall = r.seconds;
+	}
+
+	return true;
+}
+
+std::vector<uint32_t> Bench_ParseList(const char *text)
+{
+	std::vector<uint32_t> list;
+
+	while (*text)
+	{
+		char *end;
+		unsigned long v = std::strtoul(text, &end, 10);
+
+		if (end == text)
+			break;
+		if (v)
+			list.push_back((uint32_t)v);
+		text = (*end == ',') ? end + 1 : end;
+	}
+
+	return list;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	std::vector<uint32_t> sizes = {32, 64, 256, 1024, 4096, 16384, 65536};
+	std::vector<uint32_t> threads = {1};
+	uint32_t hw = std::thread::hardware_concurrency();
+	double min_time = 0.1;
+	const char *filter = "";
+	bool first = true;
+
+	if (hw > 1)
+		threads.push_back(hw);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!std::strcmp(argv[i], "--sizes") && i + 1 < argc)
+			sizes = Bench_ParseList(argv[++i]);
+		else if (!std::strcmp(argv[i], "--threads") && i + 1 < argc)
+			threads = Bench_ParseList(argv[++i]);
+		else if (!std::strcmp(argv[i], "--min-time") && i + 1 < argc)
+			min_time = std::atof(argv[++i]) / 1000.0;
+		else if (!std::strcmp(argv[i], "--filter") && i + 1 < argc)
+			filter = argv[++i];
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--sizes 32,64,...] [--threads 1,2,...] [--min-time ms] [--filter substring]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (sizes.empty() || threads.empty())
+		return 1;
+
+	std::printf("{\n\t\"min_time_ms\": %.0f,\n\t\"hardware_threads\": %u,\n\t\"results\": [", min_time * 1000.0, hw);
+	for (const bench_t &bench : g_benchmarks)
+	{
+		if (!std::strstr(bench.name, filter))
+			continue;
+
+		for (size_t s = 0; s < sizes.size(); s++)
+		{
+			uint32_t size = sizes[s] < 32 ? 32 : sizes[s];
+
+			if (!bench.sized && s > 0)
+				break;
+			if (bench.slot && size < 32 + sizeof(uint64_t))
+				continue;
+
+			for (uint32_t t : threads)
+			{
+				bench_result_t total;
+				double wall;
+
+				if (!Bench_Run(bench, size, t, min_time, &total, &wall))
+				{
+					std::fprintf(stderr, "%s: cannot build a %u byte state\n", bench.name, size);
+					continue;
+				}
+
+				std::printf("%s\n\t\t{\"name\": \"%s\", \"state_size\": %u, \"threads\": %u, \"ops\": %llu, "
+					"\"ns_per_op\": %.3f, \"mops_per_s\": %.3f}",
+					first ? "" : ",", bench.name, bench.sized ? size : 0, t, (unsigned long long)total.ops,
+					total.seconds * 1e9 / (double)total.ops, (double)total.ops / wall / 1e6);
+				std::fflush(stdout);
+				first = false;
+			}
+		}
+	}
+	std::printf("\n\t]\n}\n");
+
+	return 0;
+}
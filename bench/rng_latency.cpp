@@ -0,0 +1,266 @@
+/*
+	Latency distribution of request-shaped sequences of stack operations.
+
+	Each scenario replays the same pseudo-random list of requests. Most requests push a shallow key of 1 to
+	16 words, and one in a hundred pushes a deep one of up to --max-depth bytes. A request pushes its key,
+	draws one output and pops the key again. Every request and every single Push is timed into a log-linear
+	histogram (values below 128 ns are exact, larger ones within 1/64 of their value), and p50, p99, p99.9 and
+	max are reported as JSON on stdout. Each scenario is run as is, and again after RNG_ReserveUserStack of
+	the maximum depth, to show the reallocation stalls that the reservation removes.
+
+	Build (see the README):
+		cc -std=c11 -O2 -c src/rng.c -o rng.o
+		c++ -std=c++11 -O2 bench/rng_latency.cpp rng.o -o rng_latency -lpthread
+
+	Usage: rng_latency [--requests n] [--max-depth bytes] [--seed n]
+*/
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../inc/rng.h"
+
+namespace
+{
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+// HdrHistogram-style log-linear histogram of nanosecond values
+struct histogram_t
+{
+	static const int		SUB_BITS = 7;
+	static const uint64_t	SUB_COUNT = (uint64_t)1 << SUB_BITS;
+
+	std::vector<uint64_t>	counts;
+	uint64_t				total;
+	uint64_t				max;
+	double					sum;
+
+	histogram_t() : counts((64 - SUB_BITS + 2) << (SUB_BITS - 1), 0), total(0), max(0), sum(0.0)
+	{
+	}
+
+	static int MSB(uint64_t v)
+	{
+		int n = 0;
+
+		while (v >>= 1)
+			n++;
+
+		return n;
+	}
+	static size_t Index(uint64_t v)
+	{
+		int shift;
+
+		if (v < SUB_COUNT)
+			return (size_t)v;
+		shift = MSB(v) - (SUB_BITS - 1);
+
+		return ((size_t)shift << (SUB_BITS - 1)) + (size_t)(v >> shift);
+	}
+	// highest value that falls into bucket "index"
+	static uint64_t Value(size_t index)
+	{
+		size_t shift;
+
+		if (index < SUB_COUNT)
+			return index;
+		shift = (index >> (SUB_BITS - 1)) - 1;
+
+		return (((uint64_t)(index & ((SUB_COUNT >> 1) - 1)) + (SUB_COUNT >> 1) + 1) << shift) - 1;
+	}
+
+	void Record(uint64_t v)
+	{
+		counts[Index(v)]++;
+		total++;
+		sum += (double)v;
+		if (v > max)
+			max = v;
+	}
+	uint64_t Percentile(double p) const
+	{
+		uint64_t target = (uint64_t)(p / 100.0 * (double)total + 0.5);
+		uint64_t seen = 0;
+
+		if (target == 0)
+			target = 1;
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			seen += counts[i];
+			if (seen >= target)
+				return Value(i) < max ? Value(i) : max;
+		}
+
+		return max;
+	}
+};
+
+struct request_t
+{
+	uint32_t	words;		// key depth in 64-bit words
+	uint32_t	id;			// index into the ID table of the SetID scenario
+};
+
+struct scenario_t
+{
+	const char	*name;
+	bool		fresh;		// every request uses a new RNG
+	bool		shrink;		// ShrinkStack after every request
+	bool		set_id;		// SetID before every request
+};
+
+const scenario_t g_scenarios[] =
+{
+	{"push_pop",				false,	false,	false},
+	{"push_pop_shrink",			false,	true,	false},
+	{"setid_push_pop",			false,	false,	true},
+	{"setid_push_pop_shrink",	false,	true,	true},
+	{"new_push_destroy",		true,	false,	false}
+};
+
+uint64_t Bench_Now()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock_t::now().time_since_epoch()).count();
+}
+
+bool Bench_Prepare(rng_t *rng, uint32_t max_depth, bool reserve)
+{
+	*rng = RNG_New();
+	if (!RNG_IsValid(rng))
+		return false;
+	if (RNG_SetTotalMaxStackSize(rng, max_depth * 2 + 1024) || RNG_SetUserMaxStackSize(rng, max_depth))
+		return false;
+
+	return !reserve || !RNG_ReserveUserStack(rng, max_depth);
+}
+
+void Bench_Print(const char *name, bool reserve, const char *kind, const histogram_t &h, bool *first)
+{
+	std::printf("%s\n\t\t{\"name\": \"%s\", \"reserve\": %s, \"kind\": \"%s\", \"count\": %llu, \"mean_ns\": %.1f, "
+		"\"p50_ns\": %llu, \"p99_ns\": %llu, \"p99_9_ns\": %llu, \"max_ns\": %llu}",
+		*first ? "" : ",", name, reserve ? "true" : "false", kind, (unsigned long long)h.total,
+		h.total ? h.sum / (double)h.total : 0.0, (unsigned long long)h.Percentile(50.0),
+		(unsigned long long)h.Percentile(99.0), (unsigned long long)h.Percentile(99.9), (unsigned long long)h.max);
+	*first = false;
+}
+
+bool Bench_Scenario(const scenario_t &sc, bool reserve, const std::vector<request_t> &requests,
+	const std::vector<std::vector<char> > &ids, uint32_t max_depth, histogram_t *request_hist, histogram_t *push_hist)
+{
+	rng_t rng;
+	uint64_t sink = 0;
+	uint64_t t0, t1, t2;
+
+	if (!sc.fresh && !Bench_Prepare(&rng, max_depth, reserve))
+		return false;
+
+	for (const request_t &req : requests)
+	{
+		t0 = Bench_Now();
+
+		if (sc.fresh && !Bench_Prepare(&rng, max_depth, reserve))
+			return false;
+		if (sc.set_id)
+			RNG_SetID(&rng, (void*)ids[req.id].data(), (uint32_t)ids[req.id].size());
+
+		for (uint32_t w = 0; w < req.words; w++)
+		{
+			t1 = Bench_Now();
+			RNG_Pushu64(&rng, w);
+			t2 = Bench_Now();
+			push_hist->Record(t2 - t1);
+		}
+		sink += RNG_Randomu64(&rng);
+
+		if (sc.fresh)
+			RNG_Destroy(&rng);
+		else
+		{
+			for (uint32_t w = 0; w < req.words; w++)
+				RNG_Popu64(&rng, 0);
+			if (sc.shrink)
+				RNG_ShrinkStack(&rng);
+		}
+
+		request_hist->Record(Bench_Now() - t0);
+	}
+
+	if (!sc.fresh)
+		RNG_Destroy(&rng);
+	if (sink == 1)
+		std::fprintf(stderr, "\n"); // keeps the outputs alive
+
+	return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	uint32_t count = 200000;
+	uint32_t max_depth = 65536;
+	uint64_t seed = 1;
+	std::vector<request_t> requests;
+	std::vector<std::vector<char> > ids;
+	bool first = true;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!std::strcmp(argv[i], "--requests") && i + 1 < argc)
+			count = (uint32_t)std::strtoul(argv[++i], 0, 10);
+		else if (!std::strcmp(argv[i], "--max-depth") && i + 1 < argc)
+			max_depth = (uint32_t)std::strtoul(argv[++i], 0, 10);
+		else if (!std::strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = std::strtoull(argv[++i], 0, 10);
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--requests n] [--max-depth bytes] [--seed n]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_depth < 16 * sizeof(uint64_t))
+		max_depth = 16 * sizeof(uint64_t);
+
+	// the workload is generated up front so that every scenario replays the same requests
+	std::mt19937_64 gen(seed);
+	for (uint32_t i = 0; i < 64; i++)
+		ids.push_back(std::vector<char>(4 + gen() % 200, (char)('a' + i % 26)));
+	for (uint32_t i = 0; i < count; i++)
+	{
+		request_t req;
+
+		if (gen() % 100 == 0)
+			req.words = 1 + (uint32_t)(gen() % (max_depth / sizeof(uint64_t)));
+		else
+			req.words = 1 + (uint32_t)(gen() % 16);
+		req.id = (uint32_t)(gen() % ids.size());
+		requests.push_back(req);
+	}
+
+	std::printf("{\n\t\"requests\": %u,\n\t\"max_depth\": %u,\n\t\"results\": [", count, max_depth);
+	for (const scenario_t &sc : g_scenarios)
+	{
+		for (int reserve = 0; reserve < 2; reserve++)
+		{
+			histogram_t request_hist;
+			histogram_t push_hist;
+
+			if (!Bench_Scenario(sc, reserve != 0, requests, ids, max_depth, &request_hist, &push_hist))
+			{
+				std::fprintf(stderr, "%s: RNG setup failed\n", sc.name);
+				continue;
+			}
+			Bench_Print(sc.name, reserve != 0, "request", request_hist, &first);
+			Bench_Print(sc.name, reserve != 0, "push", push_hist, &first);
+			std::fflush(stdout);
+		}
+	}
+	std::printf("\n\t]\n}\n");
+
+	return 0;
+}
@@ -0,0 +1,345 @@
+/*
+	Thread scaling of the README loop, and the placements that make it scale or not.
+
+	Every thread runs "SetRelativeu64(1, i); Randomu64" on its own RNG, pinned to its own CPU, for a fixed
+	time. The RNGs are placed three ways: packed next to each other in one array, padded so that each starts
+	on its own cache line, or as a thread_local of the thread using it. Each placement is run with states
+	in the inline buffer, with plain heap states, and with heap states allocated by RNG_SetCacheAligned. The
+	packed and padded RNGs, and their heap states, are all created by the main thread, as an application
+	that sets up its generators before starting its workers would.
+
+	Before each run, the cache lines covered by each thread's rng_t and state buffer are collected, and the
+	lines touched by more than one thread are reported as "shared_lines". Throughput is reported in total
+	and per thread, with the efficiency against the single-thread run of the same placement and state; shared
+	lines together with poor efficiency are the signature of false sharing.
+
+	Build (see the README):
+		cc -std=c11 -O2 -c src/rng.c -o rng.o
+		c++ -std=c++11 -O2 bench/rng_scaling.cpp rng.o -o rng_scaling -lpthread
+
+	Usage: rng_scaling [--threads 1,2,...] [--min-time ms] [--heap-size bytes]
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "../inc/rng.h"
+
+namespace
+{
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+const uintptr_t CACHE_LINE = 64;
+
+enum placement_t
+{
+	PLACEMENT_PACKED,
+	PLACEMENT_PADDED,
+	PLACEMENT_THREAD_LOCAL
+};
+
+enum state_kind_t
+{
+	STATE_INLINE,
+	STATE_HEAP,
+	STATE_HEAP_ALIGNED
+};
+
+const char *const g_placement_names[] = {"packed", "padded", "thread_local"};
+const char *const g_state_names[] = {"inline", "heap", "heap_aligned"};
+
+struct thread_result_t
+{
+	uint64_t	ops;
+	double		seconds;
+};
+
+std::atomic<uint64_t> g_sink(0);
+
+// Pins the calling thread to "cpu". Returns false where pinning is unsupported or refused.
+bool Bench_Pin(uint32_t cpu)
+{
+#if defined(_WIN32)
+	if (cpu >= sizeof(DWORD_PTR) * 8)
+		return false;
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+
+	if (cpu >= CPU_SETSIZE)
+		return false;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+// Sets up "rng" with the requested kind of state, and a 64-bit slot on top for the loop to write.
+bool Bench_MakeRNG(rng_t *rng, state_kind_t kind, uint32_t heap_size)
+{
+	*rng = RNG_New();
+	if (!RNG_IsValid(rng))
+		return false;
+	if (kind == STATE_HEAP_ALIGNED && RNG_SetCacheAligned(rng, 1))
+		return false;
+
+	// 32 bytes of counter plus one slot stays inline; the heap kinds push up to "heap_size" bytes
+	if (kind != STATE_INLINE)
+	{
+		for (uint32_t i = 32 + sizeof(uint64_t); i < heap_size; i += sizeof(uint64_t))
+		{
+			if (RNG_Pushu64(rng, i))
+				return false;
+		}
+	}
+
+	return !RNG_Pushu64(rng, 0);
+}
+
+// Adds the cache lines covered by [ptr, ptr + size) to "lines", tagged with "thread".
+void Bench_AddLines(std::map<uintptr_t, std::vector<uint32_t> > *lines, const void *ptr, size_t size, uint32_t thread)
+{
+	uintptr_t first = (uintptr_t)ptr / CACHE_LINE;
+	uintptr_t last = ((uintptr_t)ptr + size - 1) / CACHE_LINE;
+
+	for (uintptr_t line = first; line <= last; line++)
+	{
+		std::vector<uint32_t> &owners = (*lines)[line];
+
+		if (std::find(owners.begin(), owners.end(), thread) == owners.end())
+			owners.push_back(thread);
+	}
+}
+
+uint32_t Bench_SharedLines(const std::map<uintptr_t, std::vector<uint32_t> > &lines)
+{
+	uint32_t shared = 0;
+
+	for (const auto &entry : lines)
+		shared += entry.second.size() > 1 ? 1 : 0;
+
+	return shared;
+}
+
+// Runs the loop on "rng" until "stop" is set, checking it every 256 iterations.
+thread_result_t Bench_Loop(rng_t *rng, const std::atomic<bool> &stop)
+{
+	thread_result_t result = {0, 0.0};
+	uint64_t sink = 0;
+	bench_clock_t::time_point start = bench_clock_t::now();
+
+	while (!stop.load(std::memory_order_relaxed))
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			RNG_SetRelativeu64(rng, 1, result.ops + i);
+			sink += RNG_Randomu64(rng);
+		}
+		result.ops += 256;
+	}
+	result.seconds = std::chrono::duration<double>(bench_clock_t::now() - start).count();
+	g_sink += sink;
+
+	return result;
+}
+
+// One timed run. Fills "results" with one entry per thread and "shared_lines" with the detector's count.
+bool Bench_Run(placement_t placement, state_kind_t kind, uint32_t threads, uint32_t heap_size, double min_time,
+	std::vector<thread_result_t> *results, uint32_t *shared_lines, bool *pinned)
+{
+	static thread_local rng_t tls_rng;
+	size_t stride = (placement == PLACEMENT_PADDED) ? (sizeof(rng_t) + CACHE_LINE - 1) & ~(CACHE_LINE - 1) : sizeof(rng_t);
+	std::vector<unsigned char> storage(stride * threads + CACHE_LINE);
+	unsigned char *base = (unsigned char*)(((uintptr_t)storage.data() + CACHE_LINE - 1) & ~(CACHE_LINE - 1));
+	std::vector<rng_t*> rngs(threads, (rng_t*)0);
+	std::map<uintptr_t, std::vector<uint32_t> > lines;
+	std::vector<std::thread> pool;
+	std::atomic<uint32_t> ready(0);
+	std::atomic<uint32_t> pin_failures(0);
+	std::atomic<bool> failed(false);
+	std::atomic<bool> stop(false);
+	uint32_t cpus = std::thread::hardware_concurrency();
+
+	// packed and padded RNGs are created up front, so their heap states come from one thread's allocations
+	if (placement != PLACEMENT_THREAD_LOCAL)
+	{
+		for (uint32_t t = 0; t < threads; t++)
+		{
+			rngs[t] = (rng_t*)(base + stride * t);
+			if (!Bench_MakeRNG(rngs[t], kind, heap_size))
+				failed = true;
+		}
+	}
+
+	results->assign(threads, thread_result_t());
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		pool.push_back(std::thread([&, t]()
+		{
+			if (!Bench_Pin(cpus ? t % cpus : t))
+				pin_failures++;
+			if (placement == PLACEMENT_THREAD_LOCAL)
+			{
+				rngs[t] = &tls_rng;
+				if (!Bench_MakeRNG(rngs[t], kind, heap_size))
+					failed = true;
+			}
+
+			// wait for every thread, then for the main thread to record the layout and start the clock
+			ready++;
+			while (ready.load() != threads + 1)
+				std::this_thread::yield();
+
+			if (!failed)
+				(*results)[t] = Bench_Loop(rngs[t], stop);
+
+			if (placement == PLACEMENT_THREAD_LOCAL)
+				RNG_Destroy(rngs[t]);
+		}));
+	}
+
+	while (ready.load() != threads)
+		std::this_thread::yield();
+	for (uint32_t t = 0; t < threads && !failed; t++)
+	{
+		Bench_AddLines(&lines, rngs[t], sizeof(rng_t), t);
+		if (rngs[t]->state)
+			Bench_AddLines(&lines, rngs[t]->state, rngs[t]->state_size_allocated_bytes, t);
+	}
+	*shared_lines = Bench_SharedLines(lines);
+
+	ready++;
+	std::this_thread::sleep_for(std::chrono::duration<double>(min_time));
+	stop = true;
+	for (std::thread &th : pool)
+		th.join();
+
+	if (placement != PLACEMENT_THREAD_LOCAL)
+	{
+		for (uint32_t t = 0; t < threads; t++)
+			RNG_Destroy(rngs[t]);
+	}
+	*pinned = pin_failures.load() == 0;
+
+	return !failed;
+}
+
+std::vector<uint32_t> Bench_ParseList(const char *text)
+{
+	std::vector<uint32_t> list;
+
+	while (*text)
+	{
+		char *end;
+		unsigned long v = std::strtoul(text, &end, 10);
+
+		if (end == text)
+			break;
+		if (v)
+			list.push_back((uint32_t)v);
+		text = (*end == ',') ? end + 1 : end;
+	}
+
+	return list;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	std::vector<uint32_t> threads;
+	uint32_t hw = std::thread::hardware_concurrency();
+	uint32_t heap_size = 256;
+	double min_time = 0.2;
+	bool first = true;
+
+	for (uint32_t t = 1; t < hw; t <<= 1)
+		threads.push_back(t);
+	threads.push_back(hw ? hw : 1);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!std::strcmp(argv[i], "--threads") && i + 1 < argc)
+			threads = Bench_ParseList(argv[++i]);
+		else if (!std::strcmp(argv[i], "--min-time") && i + 1 < argc)
+			min_time = std::atof(argv[++i]) / 1000.0;
+		else if (!std::strcmp(argv[i], "--heap-size") && i + 1 < argc)
+			heap_size = (uint32_t)std::strtoul(argv[++i], 0, 10);
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--threads 1,2,...] [--min-time ms] [--heap-size bytes]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads.empty())
+		return 1;
+	// the single-thread run is the baseline of the efficiency figures
+	if (std::find(threads.begin(), threads.end(), 1u) == threads.end())
+		threads.push_back(1);
+	std::sort(threads.begin(), threads.end());
+	threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+	if (heap_size < 128)
+		heap_size = 128;
+
+	std::printf("{\n\t\"min_time_ms\": %.0f,\n\t\"hardware_threads\": %u,\n\t\"heap_size\": %u,\n\t\"rng_t_size\": %u,\n\t\"results\": [",
+		min_time * 1000.0, hw, heap_size, (uint32_t)sizeof(rng_t));
+	for (int placement = PLACEMENT_PACKED; placement <= PLACEMENT_THREAD_LOCAL; placement++)
+	{
+		for (int kind = STATE_INLINE; kind <= STATE_HEAP_ALIGNED; kind++)
+		{
+			double single = 0.0;
+
+			for (uint32_t t : threads)
+			{
+				std::vector<thread_result_t> results;
+				uint32_t shared_lines;
+				bool pinned;
+				double total = 0.0;
+
+				if (!Bench_Run((placement_t)placement, (state_kind_t)kind, t, heap_size, min_time, &results, &shared_lines, &pinned))
+				{
+					std::fprintf(stderr, "%s/%s: cannot build the RNGs\n", g_placement_names[placement], g_state_names[kind]);
+					break;
+				}
+				for (const thread_result_t &r : results)
+					total += r.seconds > 0.0 ? (double)r.ops / r.seconds / 1e6 : 0.0;
+				if (t == 1)
+					single = total;
+
+				std::printf("%s\n\t\t{\"placement\": \"%s\", \"state\": \"%s\", \"threads\": %u, \"pinned\": %s, "
+					"\"shared_lines\": %u, \"mops_per_s\": %.3f, \"efficiency\": %.3f, \"per_thread_mops_per_s\": [",
+					first ? "" : ",", g_placement_names[placement], g_state_names[kind], t, pinned ? "true" : "false",
+					shared_lines, total, single > 0.0 ? total / (single * t) : 0.0);
+				for (size_t i = 0; i < results.size(); i++)
+				{
+					std::printf("%s%.3f", i ? ", " : "",
+						results[i].seconds > 0.0 ? (double)results[i].ops / results[i].seconds / 1e6 : 0.0);
+				}
+				std::printf("]}");
+				std::fflush(stdout);
+				first = false;
+			}
+		}
+	}
+	std::printf("\n\t]\n}\n");
+
+	return 0;
+}
@@ -1,24 +1,141 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define RNG_ID_TYPE_STRING	1
 #define RNG_ID_TYPE_U64		2
 #define RNG_ID_TYPE_HASH	3
 #define RNG_ID_TYPE_GENERIC	4
+#define RNG_ID_TYPE_INTERNED	5
+
+#define RNG_MODE_STATELESS	0	// outputs are a pure function of the state
+#define RNG_MODE_RESERVOIR	1	// outputs are drawn from a bit reservoir that is refilled from the state
+#define RNG_MODE_STREAM		2	// outputs are consecutive values of a counter-based stream keyed by the state
+
+#define RNG_LAYOUT_FLAT		0	// the state is hashed as one flat byte string
+#define RNG_LAYOUT_TREE		1	// the state is hashed as a tree of chunk digests that is updated incrementally
+
+#define RNG_STREAM_BLOCK	8	// stream values generated per refill
+#define RNG_DIGEST_CACHE	4	// seeds whose state digests are cached until the state changes
+
+// A hash backend turns the RNG state into random bits. All functions output 128 bits as out[0] (low) and
+// out[1] (high). The stream_* functions are optional (NULL if unsupported) and must produce the same digest
+// as hash128 for the same bytes and seed; "ctx" points to stream_state_size bytes aligned to
+// stream_state_align. bulk_u64 expands a 128-bit key into out[i] = f(key, first + i).
+typedef struct rng_backend_s
+{
+	const char	*name;
+	void		(*hash128)(const void *data, size_t len, uint64_t seed, uint64_t *out);
+	size_t		stream_state_size;
+	size_t		stream_state_align;
+	void		(*stream_reset)(void *ctx, uint64_t seed);
+	void		(*stream_update)(void *ctx, const void *data, size_t len);
+	void		(*stream_digest)(const void *ctx, uint64_t *out);
+	void		(*bulk_u64)(const uint64_t *key, uint64_t first, uint64_t *out, size_t count);
+}rng_backend_t;
+
+extern const rng_backend_t RNG_BACKEND_XXH3_128;	// default: XXH3-128 state hash, SplitMix64-style bulk expansion
+extern const rng_backend_t RNG_BACKEND_XXH3_FAST;	// XXH3-128 state hash, single-multiply bulk expansion
+extern const rng_backend_t RNG_BACKEND_SIPHASH;		// SipHash-2-4-128 for both the state hash and bulk expansion
+
+#define RNG_INLINE_STATE_SIZE	64	// states up to this size live inside rng_t and need no allocation
+
+typedef struct rng_id_s rng_id_t;	// interned, reference counted ID record, see RNG_InternID
+typedef struct rng_shared_s rng_shared_t;	// stream snapshot that many threads can draw from, see RNG_SharedNew
+typedef struct rng_prefetch_s rng_prefetch_t;	// producer thread filling a ring of stream blocks, see RNG_StartPrefetch
+typedef struct rng_mode_data_s rng_mode_data_t;	// reservoir and stream state of the non-stateless modes
+typedef struct rng_digest_cache_s rng_digest_cache_t;	// state hashes kept until the state changes, see RNG_DIGEST_CACHE
+
+// Performance counters, only updated when the library is compiled with RNG_ENABLE_STATS.
+typedef struct rng_stats_s
+{
+	uint64_t	hash_calls;					// state hashes computed, including tree nodes and ID digests
+	uint64_t	hash_bytes;					// bytes fed to those hashes
+	uint64_t	float_retries;				// extra words taken by the float functions after the first
+	uint64_t	expand_calls;				// state buffer (re)allocations by RNG_ExpandStateBuffer
+	uint64_t	expand_bytes_copied;		// bytes moved by those (re)allocations
+	uint64_t	shrink_calls;				// calls to RNG_ShrinkStack
+	uint64_t	lock_spins;					// iterations spent waiting on the global spinlocks
+}rng_stats_t;
+
+// Counters of the prefetcher attached to an RNG, see RNG_GetPrefetchStats.
+typedef struct rng_prefetch_stats_s
+{
+	uint32_t	capacity;					// blocks of RNG_STREAM_BLOCK values the ring holds
+	uint32_t	fill_level;					// blocks in the ring right now
+	uint64_t	hits;						// stream blocks taken from the ring
+	uint64_t	stalls;						// stream blocks computed by the caller because the next one was not ready
+	uint64_t	retargets;					// producer restarts after a state change or stream position jump
+	uint64_t	discarded;					// blocks dropped from the ring by restarts
+}rng_prefetch_stats_t;
 
 typedef struct rng_s
 {
-	uint8_t		*state;
+	uint8_t		*state;						// heap or caller storage, or NULL while the state is held in inline_state
 	uint32_t	state_size;					// sizeof(uint64_t) * 4 + id_length + USER_DATA = state_size
 	uint32_t	state_size_allocated_bytes;	// how many bytes have been allocated for *state
 	uint32_t	max_state_size;				// how many bytes are allowed for *state
 	uint32_t	user_state_required_size;	// how many bytes must be allocated for the user portion of the stack
+	uint32_t	user_reserved_size;			// user stack bytes kept allocated by RNG_ReserveUserStack
 	uint32_t	id_length;
 	uint32_t	id_type;
+	rng_id_t	*id_record;					// record of an RNG_ID_TYPE_INTERNED ID, whose digest is stored in *state
+	void		*checkpoints;				// saved streaming hash states, one per RNG_CHECKPOINT_INTERVAL bytes of *state
+	uint32_t	checkpoint_count;			// number of leading checkpoints that still match *state
+	uint32_t	checkpoint_capacity;
+	void		*tree;						// chunk digest tree of RNG_LAYOUT_TREE, rebuilt on demand
+	uint32_t	mode;						// RNG_MODE_*
+	rng_mode_data_t	*mode_data;				// allocated by the first RNG_SetMode (or RNG_StartPrefetch) that needs it
+	uint64_t	generation;					// incremented by every change to *state
+	uint64_t	digest[2];					// 128-bit state hash with seed 0, kept until the state changes
+	rng_digest_cache_t	*digests;			// hashes with seeds 1 to RNG_DIGEST_CACHE - 1, allocated for states larger than inline_state
+	const rng_backend_t	*backend;
+	uint8_t		inline_state[RNG_INLINE_STATE_SIZE];
+	uint32_t	flags;
+	uint32_t	layout;						// RNG_LAYOUT_*
+	rng_stats_t	*stats;						// counters charged to this RNG, allocated by the first one, see RNG_GetStats
 }rng_t;
 
+#define RNG_BANK_LANES		4	// states hashed together by the bank kernel
+
+// A bank holds "count" RNG states of identical size as 64-bit words interleaved in groups of RNG_BANK_LANES
+// states, so that the same word of every state in a group is contiguous and all lanes are hashed together.
+typedef struct rng_bank_s
+{
+	uint64_t	*words;						// word w of lane l is words[(group * word_count + w) * RNG_BANK_LANES + lane]
+	uint8_t		*scratch;					// one contiguous state, used by the paths that hash a single lane
+	uint32_t	count;
+	uint32_t	state_size;					// bytes per state, identical for every lane
+	uint32_t	user_offset;				// offset of the user stack within each state
+	uint32_t	word_count;					// words per lane, including a zero padding word
+}rng_bank_t;
+
 rng_t RNG_New();
+rng_t RNG_NewWithBackend(const rng_backend_t *backend);
+rng_t RNG_NewInPlace(void *storage, uint32_t size);
+rng_t *RNG_NewBatch(uint32_t count, const rng_backend_t *backend);
+void RNG_DestroyBatch(rng_t *rngs, uint32_t count);
+rng_t RNG_FoldIn(rng_t *parent, uint64_t data);
+int RNG_Split(rng_t *parent, uint32_t n, rng_t *children);
 rng_t RNG_Clone(rng_t *old_rng);
 void RNG_Destroy(rng_t *rng);
 int RNG_IsValid(rng_t *rng);
 
+int RNG_SetMode(rng_t *rng, int mode);
+int RNG_GetMode(rng_t *rng);
+int RNG_SetStreamPosition(rng_t *rng, uint64_t position);
+uint64_t RNG_GetStreamPosition(rng_t *rng);
+uint64_t RNG_GetGeneration(rng_t *rng);
+int RNG_SetLayout(rng_t *rng, int layout);
+int RNG_GetLayout(rng_t *rng);
+const rng_backend_t *RNG_GetBackend(rng_t *rng);
+
+int RNG_GetStats(rng_t *rng, rng_stats_t *stats);
+int RNG_DumpStats(const char *path);
+
 int RNG_SetTotalMaxStackSize(rng_t *rng, uint32_t size);
 int RNG_SetUserMaxStackSize(rng_t *rng, uint32_t size);
 uint32_t RNG_GetTotalMaxStackSize(rng_t *rng);
@@ -27,7 +144,10 @@ uint32_t RNG_GetUserMaxStackSize(rng_t *rng);
 uint32_t RNG_GetTotalStackDepth(rng_t *rng);
 uint32_t RNG_GetUserStackDepth(rng_t *rng);
 
+int RNG_ReserveUserStack(rng_t *rng, uint32_t size);
 int RNG_ShrinkStack(rng_t *rng);
+int RNG_SetCacheAligned(rng_t *rng, int enable);
+int RNG_GetCacheAligned(rng_t *rng);
 
 uint32_t RNG_GetIDLength(rng_t *rng);
 
@@ -36,6 +156,11 @@ int RNG_SetIDString(rng_t *rng, char *string);
 int RNG_SetIDu64(rng_t *rng, uint64_t id);
 int RNG_SetIDStringHash(rng_t *rng, char *string);
 
+rng_id_t *RNG_InternID(const void *data, uint32_t data_len);
+rng_id_t *RNG_InternIDString(const char *string);
+void RNG_ReleaseID(rng_id_t *id);
+int RNG_SetIDInterned(rng_t *rng, rng_id_t *id);
+
 int RNG_GetIDType(rng_t *rng);
 int RNG_CopyID(rng_t *rng, void *buffer);
 
@@ -90,5 +215,60 @@ int32_t RNG_Randomi32(rng_t *rng);
 int16_t RNG_Randomi16(rng_t *rng);
 int8_t RNG_Randomi8(rng_t *rng);
 
+uint64_t RNG_RandomBits(rng_t *rng, uint32_t nbits);
+
 float RNG_Randomf32(rng_t *rng);
 double RNG_Randomf64(rng_t *rng);
+
+void RNG_Randomu64xN(rng_t *rng, uint32_t n, uint64_t *out);
+
+uint64_t RNG_RandomAtu64(rng_t *rng, const uint64_t *coords, uint32_t ncoords);
+float RNG_RandomAtf32(rng_t *rng, const uint64_t *coords, uint32_t ncoords);
+double RNG_RandomAtf64(rng_t *rng, const uint64_t *coords, uint32_t ncoords);
+
+void RNG_Fillu64(rng_t *rng, uint64_t *out, size_t count);
+void RNG_Fillf32(rng_t *rng, float *out, size_t count);
+void RNG_Fillf64(rng_t *rng, double *out, size_t count);
+
+int RNG_SweepRelativeu64(rng_t *rng, uint32_t offset, const uint64_t *keys, size_t n, uint64_t *out);
+int RNG_SweepRelativeu64f32(rng_t *rng, uint32_t offset, const uint64_t *keys, size_t n, float *out);
+int RNG_SweepRelativeu64f64(rng_t *rng, uint32_t offset, const uint64_t *keys, size_t n, double *out);
+
+rng_t *RNG_TlsGet(void);
+void RNG_TlsDestroy(void);
+uint64_t RNG_TlsRandomu64(void);
+float RNG_TlsRandomf32(void);
+double RNG_TlsRandomf64(void);
+int RNG_TlsPush(void *data, uint32_t size);
+int RNG_TlsPushu64(uint64_t x);
+int RNG_TlsPop(void *data, uint32_t size);
+int RNG_TlsPopu64(uint64_t *x);
+
+rng_shared_t *RNG_SharedNew(rng_t *rng);
+void RNG_SharedDestroy(rng_shared_t *shared);
+uint64_t RNG_SharedRandomu64(rng_shared_t *shared);
+float RNG_SharedRandomf32(rng_shared_t *shared);
+double RNG_SharedRandomf64(rng_shared_t *shared);
+void RNG_SharedFillu64(rng_shared_t *shared, uint64_t *out, size_t count);
+uint64_t RNG_SharedGetPosition(rng_shared_t *shared);
+
+int RNG_StartPrefetch(rng_t *rng, uint32_t blocks);
+void RNG_StopPrefetch(rng_t *rng);
+int RNG_GetPrefetchStats(rng_t *rng, rng_prefetch_stats_t *stats);
+
+rng_bank_t RNG_BankNew(rng_t *rngs, uint32_t count);
+void RNG_BankDestroy(rng_bank_t *bank);
+int RNG_BankIsValid(rng_bank_t *bank);
+uint32_t RNG_BankGetCount(rng_bank_t *bank);
+
+int RNG_BankSetRelative(rng_bank_t *bank, uint32_t offset, void *data, uint32_t size);
+int RNG_BankSetRelativeu64(rng_bank_t *bank, uint32_t offset, uint64_t x);
+int RNG_BankSetRelativeLane(rng_bank_t *bank, uint32_t lane, uint32_t offset, void *data, uint32_t size);
+
+void RNG_BankRandomu64(rng_bank_t *bank, uint64_t *out);
+void RNG_BankRandomf32(rng_bank_t *bank, float *out);
+void RNG_BankRandomf64(rng_bank_t *bank, double *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,12 +1,34 @@
+#if defined(_MSC_VER)
 #include <windows.h>
+#include <intrin.h>
+#else
+#include <stdatomic.h>
+#include <pthread.h>
+#endif
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <memory.h>
 #include <math.h>
 
-#include "..\inc\xxh3.h"
-#include "..\inc\rng.h"
+#include "../inc/xxh3.h"
+#if defined(RNG_X86DISPATCH)
+// route XXH128 and the XXH3 streaming updates through the runtime-dispatched kernels in xxh_x86dispatch.c
+#pragma push_macro("XXH_PUBLIC_API")
+#undef XXH_PUBLIC_API
+#define XXH_PUBLIC_API
+#undef XXH3_128bits
+#include "../inc/xxh_x86dispatch.h"
+#pragma pop_macro("XXH_PUBLIC_API")
+#endif
+#include "../inc/rng.h"
 
+#if defined(_MSC_VER)
 #define INLINE_DEF __forceinline
+#else
+#define INLINE_DEF inline __attribute__((always_inline))
+#endif
 
 #define SPINLOCK_INIT	0
 
@@ -30,18 +52,113 @@
 
 #define RNG_DEFAULT_MAX_STATE_SIZE		(1 << 16)
 
+#define RNG_BULK_GAMMA		0x9E3779B97F4A7C15ULL
+#define RNG_BULK_RETRY_BITS	4	// retry words per bulk float: FP64 needs at most 16
+#define RNG_BULK_BLOCK		256	// words generated per backend call by the float fill functions
+
+// every RNG_CHECKPOINT_INTERVAL bytes of state, the streaming hash state is saved so that later hashes
+// only need to absorb the bytes above the deepest unchanged checkpoint
+#define RNG_CHECKPOINT_INTERVAL		1024
+#define RNG_CHECKPOINT_MIN_SIZE		(RNG_CHECKPOINT_INTERVAL * 2)
+#define RNG_CHECKPOINT_ALIGN		64
+#define RNG_MULTI_LANES				8	// seeds hashed side by side per pass of RNG_XXH3_LongN
+#define RNG_MULTI_SPAN				8	// XXH3 blocks (1 KB each) every seed absorbs before moving to the next seed
+
+// RNG_LAYOUT_TREE hashes every RNG_TREE_LEAF bytes of state into a leaf digest, and every RNG_TREE_FANOUT
+// digests of a level into one digest of the level above, up to a single root
+#define RNG_TREE_LEAF		256
+#define RNG_TREE_FANOUT		16
+#define RNG_TREE_MAX_LEVELS	8	// enough for 2^32 bytes of state
+
+#define RNG_CACHE_LINE		64	// assumed cache line size, the distance kept between data written by different threads
+#define RNG_BANK_ALIGN		64
+#define RNG_BATCH_ALIGN		64
+#define RNG_BANK_MAX_STEPS	8	// XXH128_mix32B rounds needed for a 240-byte input
+
+#define RNG_DERIVE_DOMAIN	0x21216E49646C6F46ULL	// "FoldIn!!", separates child bases from other hashes of the key
+
+#define RNG_AT_LOCAL_SIZE	1024	// stack buffer of RNG_RandomAt*: flat inputs up to this size, else a stream state
+
+#define RNG_ID_TABLE_MIN	64	// initial bucket count of the interned ID table, doubled as it fills
+#define RNG_ID_DIGEST_SEED	0x44496E7265746E49ULL	// "InternID", seed of the digest stored in place of interned ID bytes
+
+#define RNG_STATE_HEADER	16	// bytes in front of every heap state: the reference count and allocation base, keeps *state 16-aligned
+
+#define RNG_FLAG_EXTERNAL	1	// *state is caller storage: never freed or resized, copied to the heap on growth
+#define RNG_FLAG_STREAM_KEY	2	// stream_key matches the state, and stream_block holds the block at stream_block_first
+#define RNG_FLAG_ALIGNED	4	// heap states start on a cache line and are padded to whole lines, see RNG_SetCacheAligned
+#define RNG_FLAG_DIGEST		8	// digest holds the state hash with seed 0
+
+#define RNG_PREFETCH_MIN_BLOCKS	2
+#define RNG_PREFETCH_MAX_BLOCKS	(1u << 20)
+#define RNG_PREFETCH_IDLE_SPINS	64		// polls of a full or idle ring before the producer blocks
+#define RNG_PREFETCH_WAKE_BLOCKS	16		// blocks of one key taken in order before the consumer wakes the producer
+
 #define RNG_EXPAND_BASE	1
 #define RNG_EXPAND_ID	2
 #define RNG_EXPAND_USER	3
 
-typedef volatile uint32_t spinlock_t;
+#if defined(_MSC_VER)
+
+typedef volatile LONG spinlock_t;
+typedef volatile LONG atomic_u32_t;
+typedef volatile LONG64 atomic_u64_t;
+
+#define ATOMIC_EXCHANGE_U32(p, x)	((uint32_t)InterlockedExchange((p), (LONG)(x)))
+#define ATOMIC_STORE_U32(p, x)		InterlockedExchange((p), (LONG)(x))
+#define ATOMIC_LOAD_U32(p)			((uint32_t)InterlockedCompareExchange((p), 0, 0))
+#define ATOMIC_FETCH_ADD_U32(p, x)	((uint32_t)InterlockedExchangeAdd((p), (LONG)(x)))
+#define ATOMIC_FETCH_SUB_U32(p, x)	((uint32_t)InterlockedExchangeAdd((p), -(LONG)(x)))
+#define ATOMIC_CAS_U32(p, e, x)		((uint32_t)InterlockedCompareExchange((p), (LONG)(x), (LONG)(e)) == (uint32_t)(e))
+#define ATOMIC_FETCH_ADD_U64(p, x)	((uint64_t)InterlockedExchangeAdd64((p), (LONG64)(x)))
+#define ATOMIC_LOAD_U64(p)			((uint64_t)InterlockedCompareExchange64((p), 0, 0))
+#define ATOMIC_STORE_U64(p, x)		InterlockedExchange64((p), (LONG64)(x))
+#define ATOMIC_LOAD_ACQ_U64(p)		((uint64_t)InterlockedCompareExchange64((p), 0, 0))
+#define ATOMIC_STORE_REL_U64(p, x)	InterlockedExchange64((p), (LONG64)(x))
+#define ATOMIC_FENCE()				MemoryBarrier()
+#define CPU_RELAX()					YieldProcessor()
+#define THREAD_LOCAL				__declspec(thread)
+
+#else
+
+typedef atomic_uint spinlock_t;
+typedef _Atomic uint32_t atomic_u32_t;
+typedef _Atomic uint64_t atomic_u64_t;
+
+#define ATOMIC_EXCHANGE_U32(p, x)	((uint32_t)atomic_exchange_explicit((p), (x), memory_order_acq_rel))
+#define ATOMIC_STORE_U32(p, x)		atomic_store_explicit((p), (x), memory_order_relaxed)
+#define ATOMIC_LOAD_U32(p)			((uint32_t)atomic_load_explicit((p), memory_order_acquire))
+#define ATOMIC_FETCH_ADD_U32(p, x)	((uint32_t)atomic_fetch_add_explicit((p), (x), memory_order_relaxed))
+#define ATOMIC_FETCH_SUB_U32(p, x)	((uint32_t)atomic_fetch_sub_explicit((p), (x), memory_order_acq_rel))
+#define ATOMIC_CAS_U32(p, e, x)		Atomic_CompareExchangeU32((p), (e), (x))
+#define ATOMIC_FETCH_ADD_U64(p, x)	((uint64_t)atomic_fetch_add_explicit((p), (x), memory_order_relaxed))
+#define ATOMIC_LOAD_U64(p)			((uint64_t)atomic_load_explicit((p), memory_order_relaxed))
+#define ATOMIC_STORE_U64(p, x)		atomic_store_explicit((p), (x), memory_order_relaxed)
+#define ATOMIC_LOAD_ACQ_U64(p)		((uint64_t)atomic_load_explicit((p), memory_order_acquire))
+#define ATOMIC_STORE_REL_U64(p, x)	atomic_store_explicit((p), (x), memory_order_release)
+#define ATOMIC_FENCE()				atomic_thread_fence(memory_order_seq_cst)
+#define THREAD_LOCAL				_Thread_local
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()					__builtin_ia32_pause()
+#else
+#define CPU_RELAX()
+#endif
+
+// Stores "x" in *p if it holds "expected", and returns non-zero if it did.
+static INLINE_DEF int Atomic_CompareExchangeU32(atomic_u32_t *p, uint32_t expected, uint32_t x)
+{
+	return atomic_compare_exchange_strong_explicit(p, &expected, x, memory_order_acq_rel, memory_order_relaxed);
+}
+
+#endif
 
 static spinlock_t g_rng_lock = SPINLOCK_INIT;
-static uint64_t g_rng_counter256[4] = {0};	// 256 bits
+static spinlock_t g_rng_id_lock = SPINLOCK_INIT;	// guards the interned ID table
+static atomic_u64_t g_rng_counter256[4] = {0};	// 256 bits, [0] is the least significant limb
 
 #define USE_BUILTIN_FUNCTIONS
 
-#ifdef USE_BUILTIN_FUNCTIONS
+#if defined(USE_BUILTIN_FUNCTIONS) && defined(_MSC_VER)
 
 #define LZCNT8(x)	return (int)__lzcnt16((uint16_t)x);
 #define LZCNT16(x)	return (int)__lzcnt16(x);
@@ -58,6 +175,23 @@ static uint64_t g_rng_counter256[4] = {0};	// 256 bits
 #define ROTL32(x, shift)	_rotl(x, shift)
 #define ROTL64(x, shift)	_rotl64(x, shift)
 
+#elif defined(USE_BUILTIN_FUNCTIONS) && defined(__GNUC__)
+
+#define LZCNT8(x)	return (x) ? __builtin_clz((uint32_t)(x)) - 24 : 8;
+#define LZCNT16(x)	return (x) ? __builtin_clz((uint32_t)(x)) - 16 : 16;
+#define LZCNT32(x)	return (x) ? __builtin_clz(x) : 32;
+#define LZCNT64(x)	return (x) ? __builtin_clzll(x) : 64;
+
+#define POPCNT8(x)	return __builtin_popcount((uint32_t)(x));
+#define POPCNT16(x)	return __builtin_popcount((uint32_t)(x));
+#define POPCNT32(x)	return __builtin_popcount(x);
+#define POPCNT64(x)	return __builtin_popcountll(x);
+
+#define ROTL8(x, shift)		(x << shift) | (x >> (8 - shift))
+#define ROTL16(x, shift)	(x << shift) | (x >> (16 - shift))
+#define ROTL32(x, shift)	(((x) << (shift)) | ((x) >> ((32 - (shift)) & 31)))
+#define ROTL64(x, shift)	(((x) << (shift)) | ((x) >> ((64 - (shift)) & 63)))
+
 #else
 
 #define POPCNT8(x)	x = (x & 0x55) + ((x & 0xAA) >> 1);\
@@ -132,20 +266,137 @@ static INLINE_DEF uint32_t Math_CeilPow2u32(uint32_t x)
 	return x;
 }
 
+static INLINE_DEF int Math_PopCnt64(uint64_t x)
+{
+	POPCNT64(x);
+}
+
 static INLINE_DEF int Math_LZCnt64(uint64_t x)
 {
 	LZCNT64(x);
 }
 
-static INLINE_DEF void SpinLock_Lock(spinlock_t *lock)
+// Returns the number of times the lock was found taken.
+static INLINE_DEF uint32_t SpinLock_Lock(spinlock_t *lock)
 {
-	while (InterlockedExchange(lock, 1) == 1)
+	uint32_t spins = 0;
+
+	while (ATOMIC_EXCHANGE_U32(lock, 1) == 1)
 	{
+		CPU_RELAX();
+		spins++;
 	}
+
+	return spins;
 }
 static INLINE_DEF void SpinLock_Unlock(spinlock_t *lock)
 {
-	InterlockedExchange(lock, 0);
+	ATOMIC_EXCHANGE_U32(lock, 0);
+}
+
+/*
+	Performance counters.
+
+	With RNG_ENABLE_STATS, every counted event is added to the rng_stats_t of the RNG it concerns, if any,
+	and to a block of counters private to the calling thread. Blocks are linked into a global list the first
+	time a thread counts something, and are kept after the thread exits, so the global totals are the sum of
+	every block ever created. Only the owning thread writes a block, so updates are a relaxed load and store
+	rather than a locked add. Without RNG_ENABLE_STATS the counting macros expand to nothing.
+*/
+#define RNG_STAT_INDEX(field)	(offsetof(rng_stats_t, field) / sizeof(uint64_t))
+#define RNG_STAT_COUNT			(sizeof(rng_stats_t) / sizeof(uint64_t))
+
+#if defined(RNG_ENABLE_STATS)
+
+typedef struct rng_stats_block_s
+{
+	atomic_u64_t				counters[RNG_STAT_COUNT];
+	struct rng_stats_block_s	*next;
+}rng_stats_block_t;
+
+static THREAD_LOCAL rng_stats_block_t *g_rng_stats_local;
+static rng_stats_block_t *g_rng_stats_blocks;				// every thread's block, guarded by g_rng_stats_lock
+static spinlock_t g_rng_stats_lock = SPINLOCK_INIT;
+
+static rng_stats_block_t *RNG_StatsLocal(void)
+{
+	rng_stats_block_t *block = g_rng_stats_local;
+
+	if (block)
+		return block;
+
+	block = MALLOC_FUNC(sizeof(rng_stats_block_t));
+	if (!block)
+		return 0;
+	memset(block, 0, sizeof(rng_stats_block_t));
+
+	SpinLock_Lock(&g_rng_stats_lock);
+	block->next = g_rng_stats_blocks;
+	g_rng_stats_blocks = block;
+	SpinLock_Unlock(&g_rng_stats_lock);
+
+	g_rng_stats_local = block;
+
+	return block;
+}
+static void RNG_StatAdd(rng_t *rng, size_t index, uint64_t x)
+{
+	rng_stats_block_t *block = RNG_StatsLocal();
+
+	// per-RNG counters are allocated by the first event charged to the RNG
+	if (rng && !rng->stats)
+	{
+		rng->stats = MALLOC_FUNC(sizeof(rng_stats_t));
+		if (rng->stats)
+			memset(rng->stats, 0, sizeof(rng_stats_t));
+	}
+	if (rng && rng->stats)
+		((uint64_t*)rng->stats)[index] += x;
+	if (block)
+		ATOMIC_STORE_U64(&block->counters[index], ATOMIC_LOAD_U64(&block->counters[index]) + x);
+}
+
+#define RNG_STAT_ADD(rng, field, x)	RNG_StatAdd((rng), RNG_STAT_INDEX(field), (uint64_t)(x))
+
+#else
+
+#define RNG_STAT_ADD(rng, field, x)	((void)(rng))
+
+#endif
+
+#define RNG_STAT_HASH(rng, len)		do { RNG_STAT_ADD(rng, hash_calls, 1); RNG_STAT_ADD(rng, hash_bytes, len); } while (0)
+
+// SpinLock_Lock for the library's global locks, counting the time spent waiting.
+static INLINE_DEF void RNG_Lock(spinlock_t *lock)
+{
+	uint32_t spins = SpinLock_Lock(lock);
+
+	if (spins)
+		RNG_STAT_ADD(0, lock_spins, spins);
+}
+
+// Hands out "count" consecutive values of the global counter, the first of which is stored in counter256.
+// The low limb is a single atomic fetch-add, so concurrent callers never wait on each other; the upper
+// limbs only change once every 2^64 reservations, when the caller whose range wrapped the low limb
+// propagates the carry under g_rng_lock.
+static INLINE_DEF void RNG_ReserveCounter256(uint64_t *counter256, uint64_t count)
+{
+	int i;
+
+	counter256[0] = ATOMIC_FETCH_ADD_U64(&g_rng_counter256[0], count);
+	for (i = 1; i < 4; i++)
+		counter256[i] = ATOMIC_LOAD_U64(&g_rng_counter256[i]);
+
+	if (counter256[0] + count < counter256[0])
+	{
+		RNG_Lock(&g_rng_lock);
+		for (i = 1; i < 4; i++)
+		{
+			if (ATOMIC_FETCH_ADD_U64(&g_rng_counter256[i], 1) != UINT64_MAX)
+				break;
+		}
+		SpinLock_Unlock(&g_rng_lock);
+	}
 }
 
 static INLINE_DEF void RNG_IncrementCounter256(uint64_t *counter256)
@@ -154,12 +405,138 @@ static INLINE_DEF void RNG_IncrementCounter256(uint64_t *counter256)
 
 	for (i = 0; i < 4; i++)
 	{
-		counter256[i]++;
-		if (counter256[i])
+		if (++counter256[i] != 0)
 			break;
 	}
 }
 
+static INLINE_DEF uint8_t *RNG_StateData(rng_t *rng)
+{
+	return rng->state ? rng->state : rng->inline_state;
+}
+
+/*
+	Heap states are reference counted so that RNG_Clone can share them. The count lives in the
+	RNG_STATE_HEADER bytes in front of *state, and a state may only be written or resized while its count
+	is 1: every writer calls RNG_UnshareState first. The last bytes of the header hold the pointer returned
+	by the allocator, which is *state - RNG_STATE_HEADER except for RNG_FLAG_ALIGNED states: these start on
+	an RNG_CACHE_LINE boundary and are padded to a whole number of lines, so that no other allocation
+	shares a cache line with the state bytes.
+*/
+static INLINE_DEF atomic_u32_t *RNG_StateRefs(uint8_t *state)
+{
+	return (atomic_u32_t*)(state - RNG_STATE_HEADER);
+}
+static INLINE_DEF void **RNG_StateBase(uint8_t *state)
+{
+	return (void**)(state - sizeof(void*));
+}
+static uint8_t *RNG_StateAlloc(uint32_t size, uint32_t flags)
+{
+	size_t bytes = (size_t)size + RNG_STATE_HEADER;
+	uint8_t *base;
+	uint8_t *ptr;
+
+	if (flags & RNG_FLAG_ALIGNED)
+		bytes = (((size_t)size + RNG_CACHE_LINE - 1) & ~(size_t)(RNG_CACHE_LINE - 1)) + RNG_STATE_HEADER + RNG_CACHE_LINE - 1;
+
+	base = MALLOC_FUNC(bytes);
+	if (!base)
+		return 0;
+
+	ptr = base + RNG_STATE_HEADER;
+	if (flags & RNG_FLAG_ALIGNED)
+		ptr = (uint8_t*)(((uintptr_t)ptr + RNG_CACHE_LINE - 1) & ~(uintptr_t)(RNG_CACHE_LINE - 1));
+	*RNG_StateBase(ptr) = base;
+	ATOMIC_STORE_U32(RNG_StateRefs(ptr), 1);
+
+	return ptr;
+}
+// Resizes a private heap state to "size" bytes, keeping its first "used" bytes. Plain states are resized in
+// place by the allocator; aligned ones, and states changing between the two kinds, are moved.
+static uint8_t *RNG_StateRealloc(uint8_t *state, uint32_t size, uint32_t used, uint32_t flags)
+{
+	uint8_t *base = *RNG_StateBase(state);
+	uint8_t *ptr;
+
+	if (!(flags & RNG_FLAG_ALIGNED) && (base == state - RNG_STATE_HEADER))
+	{
+		base = REALLOC_FUNC(base, (size_t)size + RNG_STATE_HEADER);
+		if (!base)
+			return 0;
+		ptr = base + RNG_STATE_HEADER;
+		*RNG_StateBase(ptr) = base;
+		return ptr;
+	}
+
+	ptr = RNG_StateAlloc(size, flags);
+	if (!ptr)
+		return 0;
+	memcpy(ptr, state, used < size ? used : size);
+	FREE_FUNC(base);
+
+	return ptr;
+}
+static void RNG_StateRelease(uint8_t *state)
+{
+	if (state && (ATOMIC_FETCH_SUB_U32(RNG_StateRefs(state), 1) == 1))
+		FREE_FUNC(*RNG_StateBase(state));
+}
+static INLINE_DEF int RNG_StateIsShared(rng_t *rng)
+{
+	return rng->state && !(rng->flags & RNG_FLAG_EXTERNAL) && (ATOMIC_LOAD_U32(RNG_StateRefs(rng->state)) > 1);
+}
+
+// Smallest buffer the state may live in: the live bytes, or more while RNG_ReserveUserStack is in effect.
+static INLINE_DEF uint32_t RNG_RequiredStateSize(rng_t *rng)
+{
+	uint64_t size = (uint64_t)sizeof(uint64_t) * 4 + rng->id_length + rng->user_reserved_size;
+
+	if (size < rng->state_size)
+		size = rng->state_size;
+	if (size > rng->max_state_size)
+		size = rng->max_state_size;
+
+	return (uint32_t)size;
+}
+
+// Gives the RNG a private copy of a shared state: only the live bytes are copied, into the inline buffer
+// if they (and any reservation) fit, or else into a heap buffer of the next power-of-two size.
+static int RNG_UnshareState(rng_t *rng)
+{
+	uint32_t required = RNG_RequiredStateSize(rng);
+	uint32_t size = Math_CeilPow2u32(required);
+	uint8_t *ptr;
+
+	if (!RNG_StateIsShared(rng))
+		return 0;
+
+	if (required <= RNG_INLINE_STATE_SIZE)
+	{
+		memcpy(rng->inline_state, rng->state, rng->state_size);
+		RNG_StateRelease(rng->state);
+		rng->state = 0;
+		rng->state_size_allocated_bytes = RNG_INLINE_STATE_SIZE;
+		return 0;
+	}
+
+	if (size > rng->max_state_size)
+		size = rng->max_state_size;
+
+	ptr = RNG_StateAlloc(size, rng->flags);
+	if (!ptr)
+		return -1;
+	memcpy(ptr, rng->state, rng->state_size);
+
+	RNG_StateRelease(rng->state);
+	rng->state = ptr;
+	rng->state_size_allocated_bytes = size;
+
+	return 0;
+}
+
+// Grows the state buffer to hold "size" bytes, doubling the capacity. Inline and caller-provided storage
+// is never resized in place: the first growth past it moves the state to the heap.
 static INLINE_DEF int RNG_ExpandStateBuffer(rng_t *rng, uint32_t size, int type)
 {
 	uint32_t old_size = rng->state_size_allocated_bytes;
@@ -177,520 +554,3850 @@ static INLINE_DEF int RNG_ExpandStateBuffer(rng_t *rng, uint32_t size, int type)
 		new_size = req_user_size + rng->id_length + sizeof(uint64_t) * 4;
 	}
 
+	if (new_size > rng->max_state_size)
+		return -1;
+	if (RNG_UnshareState(rng))
+		return -1;
+	old_size = rng->state_size_allocated_bytes;
 	if (old_size >= new_size)
 		return 0;
 
 	if (old_size == 0)
 		old_size = 1;
 
-	while ((old_size < new_size) && (old_size != 0) && (old_size < rng->max_state_size))
+	while ((old_size < new_size) && (old_size < rng->max_state_size))
 	{
 		old_size <<= 1;
 	}
-	if ((old_size == 0) || (old_size > rng->max_state_size) || (old_size < new_size))
-		return -1;
-
-	rng->state_size_allocated_bytes = old_size;
-	ptr = REALLOC_FUNC(rng->state, rng->state_size_allocated_bytes);
+	if (old_size > rng->max_state_size)
+		old_size = rng->max_state_size;
 
-	if (!ptr)
-		return -1;
+	if (!rng->state || (rng->flags & RNG_FLAG_EXTERNAL))
+	{
+		ptr = RNG_StateAlloc(old_size, rng->flags);
+		if (!ptr)
+			return -1;
+		if (rng->state_size)
+			memcpy(ptr, RNG_StateData(rng), rng->state_size);
+		rng->flags &= ~RNG_FLAG_EXTERNAL;
+		RNG_STAT_ADD(rng, expand_bytes_copied, rng->state_size);
+	}
+	else
+	{
+		ptr = RNG_StateRealloc(rng->state, old_size, rng->state_size, rng->flags);
+		if (!ptr)
+			return -1;
+		if (ptr != rng->state)
+			RNG_STAT_ADD(rng, expand_bytes_copied, rng->state_size_allocated_bytes);
+	}
+	RNG_STAT_ADD(rng, expand_calls, 1);
 
 	rng->state = ptr;
+	rng->state_size_allocated_bytes = old_size;
 
 	return 0;
 }
 
-void RNG_Destroy(rng_t *rng)
+static INLINE_DEF void *Mem_AlignedMalloc(size_t size, size_t align)
 {
-	if (!rng)
-		return;
-	FREE_FUNC(rng->state);
-	memset(rng, 0, sizeof(rng_t));
-}
+	uint8_t *base = MALLOC_FUNC(size + align + sizeof(void*));
+	uint8_t *ptr;
 
-int RNG_IsValid(rng_t *rng)
+	if (!base)
+		return 0;
+
+	ptr = (uint8_t*)(((uintptr_t)base + sizeof(void*) + align - 1) & ~(uintptr_t)(align - 1));
+	((void**)ptr)[-1] = base;
+
+	return ptr;
+}
+static INLINE_DEF void Mem_AlignedFree(void *ptr)
 {
-	return (rng->state != 0 && rng->state_size >= sizeof(uint64_t)*4) ? 1 : 0;
+	if (ptr)
+		FREE_FUNC(((void**)ptr)[-1]);
 }
 
-int RNG_SetTotalMaxStackSize(rng_t *rng, uint32_t size)
-{
-	size = Math_CeilPow2u32(size);
+/*
+	Hash backends.
 
-	if (size == 0)
-		return -1;
-	if (size < rng->state_size_allocated_bytes)
-		return -1;
+	RNG_BACKEND_XXH3_128 is the default and the only backend the Random* functions special-case, so that
+	the common path calls XXH128 directly instead of going through a function pointer.
+*/
 
-	rng->max_state_size = size;
+// Counter-based generator used by the bulk functions: output "index" of the stream keyed by "key". This is
+// the SplitMix64 finaliser over a Weyl sequence, with the second key half injected between the two
+// multiplies, so every output is an independent function of (key, index) and the loop has no carried state.
+static INLINE_DEF uint64_t RNG_BulkMix64(uint64_t k0, uint64_t k1, uint64_t index)
+{
+	uint64_t z = k0 + index * RNG_BULK_GAMMA;
 
-	return 0;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27) ^ k1) * 0x94D049BB133111EBULL;
+
+	return z ^ (z >> 31);
 }
-int RNG_SetUserMaxStackSize(rng_t *rng, uint32_t size)
+
+// wyrand-style single multiply: the 128-bit product of two keyed Weyl sequences, folded to 64 bits
+static INLINE_DEF uint64_t RNG_FastMix64(uint64_t k0, uint64_t k1, uint64_t index)
 {
-	uint32_t current_offset = rng->state_size - rng->id_length - sizeof(uint64_t) * 4;
-	
-	size = Math_CeilPow2u32(size);
+	uint64_t a = k0 + index * RNG_BULK_GAMMA;
+	XXH128_hash_t p = XXH_mult64to128(a, a ^ k1 ^ 0xE7037ED1A0B428DBULL);
 
-	if (size == 0)
-		return -1;
-	if (size < current_offset)
-		return -1;
+	return p.low64 ^ p.high64;
+}
 
-	rng->user_state_required_size = size;
+static void RNG_XXH3_Hash128(const void *data, size_t len, uint64_t seed, uint64_t *out)
+{
+	XXH128_hash_t h = XXH128(data, len, seed);
 
-	return 0;
+	out[0] = h.low64;
+	out[1] = h.high64;
 }
-int RNG_ShrinkStack(rng_t *rng)
+static void RNG_XXH3_StreamReset(void *ctx, uint64_t seed)
 {
-	uint32_t old_size = rng->state_size_allocated_bytes;
-	uint32_t target_size = Math_CeilPow2u32(rng->state_size);
-	void *ptr;
-
-	if (target_size == rng->state_size_allocated_bytes)
-		return 0;
+	XXH3_128bits_reset_withSeed((XXH3_state_t*)ctx, seed);
+}
+static void RNG_XXH3_StreamUpdate(void *ctx, const void *data, size_t len)
+{
+	XXH3_128bits_update((XXH3_state_t*)ctx, data, len);
+}
+static void RNG_XXH3_StreamDigest(const void *ctx, uint64_t *out)
+{
+	XXH128_hash_t h = XXH3_128bits_digest((const XXH3_state_t*)ctx);
 
-	while ((old_size >> 1) >= target_size)
-		old_size >>= 1;
+	out[0] = h.low64;
+	out[1] = h.high64;
+}
+static void RNG_XXH3_Bulk(const uint64_t *key, uint64_t first, uint64_t *out, size_t count)
+{
+	uint64_t k0 = key[0];
+	uint64_t k1 = key[1];
+	size_t i;
 
-	if (old_size == rng->state_size_allocated_bytes)
-		return 0;
+	for (i = 0; i < count; i++)
+		out[i] = RNG_BulkMix64(k0, k1, first + i);
+}
+static void RNG_Fast_Bulk(const uint64_t *key, uint64_t first, uint64_t *out, size_t count)
+{
+	uint64_t k0 = key[0];
+	uint64_t k1 = key[1];
+	size_t i;
 
-	ptr = REALLOC_FUNC(rng->state, old_size);
+	for (i = 0; i < count; i++)
+		out[i] = RNG_FastMix64(k0, k1, first + i);
+}
 
-	if (!ptr)
-		return -1;
+// SipHash-2-4 with 128-bit output. The seed becomes the 128-bit key (seed, ~seed).
+typedef struct siphash_state_s
+{
+	uint64_t	v[4];
+	uint64_t	tail;
+	uint64_t	total_len;
+}siphash_state_t;
 
-	rng->state = ptr;
-	rng->state_size_allocated_bytes = old_size;
+#define SIPROUND(v)	do {\
+					v[0] += v[1]; v[1] = ROTL64(v[1], 13); v[1] ^= v[0]; v[0] = ROTL64(v[0], 32);\
+					v[2] += v[3]; v[3] = ROTL64(v[3], 16); v[3] ^= v[2];\
+					v[0] += v[3]; v[3] = ROTL64(v[3], 21); v[3] ^= v[0];\
+					v[2] += v[1]; v[1] = ROTL64(v[1], 17); v[1] ^= v[2]; v[2] = ROTL64(v[2], 32);\
+					} while (0)
 
-	return 0;
-}
-uint32_t RNG_GetTotalMaxStackSize(rng_t *rng)
+static INLINE_DEF void SipHash_Init(siphash_state_t *sip, uint64_t k0, uint64_t k1)
 {
-	return rng->max_state_size;
+	sip->v[0] = 0x736F6D6570736575ULL ^ k0;
+	sip->v[1] = 0x646F72616E646F6DULL ^ k1 ^ 0xEE;
+	sip->v[2] = 0x6C7967656E657261ULL ^ k0;
+	sip->v[3] = 0x7465646279746573ULL ^ k1;
+	sip->tail = 0;
+	sip->total_len = 0;
 }
-uint32_t RNG_GetUserMaxStackSize(rng_t *rng)
+static INLINE_DEF void SipHash_Compress(uint64_t *v, uint64_t m)
 {
-	uint32_t overhead = rng->id_length + sizeof(uint64_t) * 4;
-
-	if (rng->max_state_size - overhead < rng->user_state_required_size)
-		return rng->max_state_size - overhead;
-	else
-		return rng->user_state_required_size;
+	v[3] ^= m;
+	SIPROUND(v);
+	SIPROUND(v);
+	v[0] ^= m;
 }
-rng_t RNG_New()
+static void SipHash_Update(siphash_state_t *sip, const void *data, size_t len)
 {
-	rng_t rng = {0};
+	const uint8_t *p = (const uint8_t*)data;
+	uint32_t fill = (uint32_t)(sip->total_len & 7);
+	uint64_t m;
 
-	rng.state_size = (uint32_t)sizeof(uint64_t) * 4;
-	rng.max_state_size = RNG_DEFAULT_MAX_STATE_SIZE;
-	rng.user_state_required_size = RNG_DEFAULT_MAX_STATE_SIZE;
+	sip->total_len += len;
 
-	if (RNG_ExpandStateBuffer(&rng, (uint32_t)sizeof(uint64_t) * 4, RNG_EXPAND_BASE))
+	while (fill && len)
 	{
-		FREE_FUNC(rng.state);
-		memset(&rng, 0, (uint32_t)sizeof(rng_t));
-		return rng; // non-valid RNG
+		sip->tail |= ((uint64_t)*p++) << (fill * 8);
+		len--;
+		fill = (fill + 1) & 7;
+		if (!fill)
+		{
+			SipHash_Compress(sip->v, sip->tail);
+			sip->tail = 0;
+		}
+	}
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		m = XXH_readLE64(p);
+		SipHash_Compress(sip->v, m);
 	}
+	for (fill = 0; fill < len; fill++)
+		sip->tail |= ((uint64_t)p[fill]) << (fill * 8);
+}
+static void SipHash_Digest(const siphash_state_t *sip, uint64_t *out)
+{
+	uint64_t v[4];
+	uint64_t b = (sip->total_len << 56) | sip->tail;
 
-	SpinLock_Lock(&g_rng_lock);
-	memcpy(rng.state, g_rng_counter256, (uint32_t)sizeof(uint64_t) * 4); // C6387, false positive
-	RNG_IncrementCounter256(g_rng_counter256);
-	SpinLock_Unlock(&g_rng_lock);
+	memcpy(v, sip->v, sizeof(v));
+	SipHash_Compress(v, b);
 
-	return rng;
+	v[2] ^= 0xEE;
+	SIPROUND(v);
+	SIPROUND(v);
+	SIPROUND(v);
+	SIPROUND(v);
+	out[0] = v[0] ^ v[1] ^ v[2] ^ v[3];
+
+	v[1] ^= 0xDD;
+	SIPROUND(v);
+	SIPROUND(v);
+	SIPROUND(v);
+	SIPROUND(v);
+	out[1] = v[0] ^ v[1] ^ v[2] ^ v[3];
 }
-rng_t RNG_Clone(rng_t *old_rng)
+
+static void RNG_SipHash_Hash128(const void *data, size_t len, uint64_t seed, uint64_t *out)
 {
-	rng_t rng = *old_rng;
+	siphash_state_t sip;
 
-	rng.state = 0;
-	rng.state_size_allocated_bytes = 0;
+	SipHash_Init(&sip, seed, ~seed);
+	SipHash_Update(&sip, data, len);
+	SipHash_Digest(&sip, out);
+}
+static void RNG_SipHash_StreamReset(void *ctx, uint64_t seed)
+{
+	SipHash_Init((siphash_state_t*)ctx, seed, ~seed);
+}
+static void RNG_SipHash_StreamUpdate(void *ctx, const void *data, size_t len)
+{
+	SipHash_Update((siphash_state_t*)ctx, data, len);
+}
+static void RNG_SipHash_StreamDigest(const void *ctx, uint64_t *out)
+{
+	SipHash_Digest((const siphash_state_t*)ctx, out);
+}
+// every output is SipHash-2-4 of the 8-byte index under the 128-bit key
+static void RNG_SipHash_Bulk(const uint64_t *key, uint64_t first, uint64_t *out, size_t count)
+{
+	siphash_state_t sip;
+	uint64_t h[2];
+	size_t i;
 
-	if (RNG_ExpandStateBuffer(&rng, old_rng->state_size_allocated_bytes, RNG_EXPAND_BASE))
+	for (i = 0; i < count; i++)
 	{
-		FREE_FUNC(rng.state);
-		memset(&rng, 0, (uint32_t)sizeof(rng_t));
-		return rng; // non-valid RNG
+		SipHash_Init(&sip, key[0], key[1]);
+		SipHash_Compress(sip.v, first + i);
+		sip.total_len = 8;
+		SipHash_Digest(&sip, h);
+		out[i] = h[0];
 	}
-
-	memcpy(rng.state, old_rng->state, rng.state_size_allocated_bytes);
-
-	return rng;
 }
 
-int RNG_SetID(rng_t *rng, void *data, uint32_t data_len)
+const rng_backend_t RNG_BACKEND_XXH3_128 =
 {
-	uint32_t new_id_length = data_len;
-	uint32_t old_userdata_size = rng->state_size - rng->id_length - (uint32_t)sizeof(uint64_t) * 4;
-	uint32_t req_size = old_userdata_size + new_id_length + (uint32_t)sizeof(uint64_t) * 4;
-	uint8_t *old_userdata_p;
-	uint8_t *new_userdata_p;
+	"xxh3-128",
+	RNG_XXH3_Hash128,
+	sizeof(XXH3_state_t),
+	64,
+	RNG_XXH3_StreamReset,
+	RNG_XXH3_StreamUpdate,
+	RNG_XXH3_StreamDigest,
+	RNG_XXH3_Bulk
+};
+const rng_backend_t RNG_BACKEND_XXH3_FAST =
+{
+	"xxh3-fast",
+	RNG_XXH3_Hash128,
+	sizeof(XXH3_state_t),
+	64,
+	RNG_XXH3_StreamReset,
+	RNG_XXH3_StreamUpdate,
+	RNG_XXH3_StreamDigest,
+	RNG_Fast_Bulk
+};
+const rng_backend_t RNG_BACKEND_SIPHASH =
+{
+	"siphash-2-4-128",
+	RNG_SipHash_Hash128,
+	sizeof(siphash_state_t),
+	sizeof(uint64_t),
+	RNG_SipHash_StreamReset,
+	RNG_SipHash_StreamUpdate,
+	RNG_SipHash_StreamDigest,
+	RNG_SipHash_Bulk
+};
 
-	if (RNG_ExpandStateBuffer(rng, req_size, RNG_EXPAND_ID))
-		return -1; // valid RNG but without ID updated
+static INLINE_DEF XXH128_hash_t RNG_BackendHash128(const rng_backend_t *backend, const void *data, size_t len, uint64_t seed)
+{
+	XXH128_hash_t h;
+	uint64_t out[2];
 
-	old_userdata_p = &rng->state[(uint32_t)sizeof(uint64_t) * 4 + rng->id_length];
-	new_userdata_p = &rng->state[(uint32_t)sizeof(uint64_t) * 4 + new_id_length];
+	if (backend == &RNG_BACKEND_XXH3_128)
+		return XXH128(data, len, seed);
 
-	memmove(new_userdata_p, old_userdata_p, old_userdata_size);
-	memcpy(&rng->state[(uint32_t)sizeof(uint64_t) * 4], data, new_id_length);
+	backend->hash128(data, len, seed, out);
+	h.low64 = out[0];
+	h.high64 = out[1];
 
-	rng->state_size = rng->state_size + new_id_length - rng->id_length;
-	rng->id_length = new_id_length;
-	rng->id_type = RNG_ID_TYPE_GENERIC;
+	return h;
+}
 
-	return 0;
+static INLINE_DEF size_t RNG_CheckpointStride(const rng_backend_t *backend)
+{
+	return (backend->stream_state_size + backend->stream_state_align - 1) & ~(backend->stream_state_align - 1);
 }
-int RNG_SetIDString(rng_t *rng, char *string)
+
+/*
+	State of the reservoir and stream modes. Most RNGs stay stateless, so this lives out of line: it is
+	allocated by the first RNG_SetMode to another mode (or by RNG_StartPrefetch), and kept until RNG_Destroy.
+*/
+struct rng_mode_data_s
 {
-	int ret = RNG_SetID(rng, string, (uint32_t)strlen(string));
+	uint32_t		reservoir_bits;			// number of unused bits left in reservoir
+	uint64_t		reservoir[2];
+	uint64_t		reservoir_seed;			// seed of the next hash used to refill reservoir
+	uint64_t		stream_key[2];			// state hash keying the stream
+	uint64_t		stream_position;		// index of the next stream value
+	uint64_t		stream_block_first;		// index of stream_block[0]
+	uint64_t		stream_block[RNG_STREAM_BLOCK];
+	rng_prefetch_t	*prefetch;				// producer thread filling stream blocks ahead, see RNG_StartPrefetch
+};
+
+// State hashes with seeds 1 to RNG_DIGEST_CACHE - 1 of a state larger than inline_state, see
+// RNG_StateDigest128. Emptied by every change to the state.
+struct rng_digest_cache_s
+{
+	uint32_t	valid;						// bit i is set if digest[i - 1] holds the state hash with seed i
+	uint64_t	digest[RNG_DIGEST_CACHE - 1][2];
+};
+
+// A copy of "from" without its prefetcher, or an empty state if "from" is NULL.
+static rng_mode_data_t *RNG_ModeDataNew(const rng_mode_data_t *from)
+{
+	rng_mode_data_t *md = MALLOC_FUNC(sizeof(rng_mode_data_t));
+
+	if (!md)
+		return 0;
+
+	if (from)
+		*md = *from;
+	else
+		memset(md, 0, sizeof(rng_mode_data_t));
+	md->prefetch = 0;
+
+	return md;
+}
+
+/*
+	Background prefetching.
+
+	A prefetcher is a producer thread that keeps a single-producer single-consumer ring filled with blocks of
+	RNG_STREAM_BLOCK stream values, so that RNG_StreamRefill can copy a finished block instead of calling
+	bulk_u64 on the caller's thread. The producer works on a target (key, first value), and block b of a
+	target holds bulk_u64(key, first + b * RNG_STREAM_BLOCK), exactly what RNG_StreamRefill would compute, so
+	outputs never depend on where a block came from. The RNG's thread is the only consumer. When it needs a
+	block other than the next one of the target, because the state or the stream position changed, it
+	computes that block itself and retargets the producer to the block after it: the new target is written
+	under a spinlock and published by bumping the epoch, and ring blocks of an older epoch are dropped.
+	The consumer also publishes the next value it needs, so that a producer that has fallen behind skips
+	ahead instead of filling the ring with blocks that are already consumed. Each side's indices are
+	written by that side only, and live on separate cache lines.
+
+	A producer with a full ring or no target spins briefly, then sets "waiting" and blocks on a condition
+	variable. The consumer wakes it when a take leaves the ring half empty, once the current key has
+	delivered RNG_PREFETCH_WAKE_BLOCKS blocks in order. Keys that are replaced sooner never pay for a wake,
+	which costs more than the few blocks the producer could have made for them. Both sides put a full fence
+	between their own store and their read of the other side's flag or index, so either the producer sees
+	the new index before it blocks or the consumer sees "waiting" and signals. An idle prefetcher therefore
+	costs no CPU time, and the consumer only takes the lock to wake it.
+
+	A rekey is left to the consumer: the key is the hash of a state only the consumer's thread may read,
+	and the first block of a new key is needed at once, before a producer could have made it.
+*/
+typedef struct rng_prefetch_slot_s
+{
+	uint64_t	epoch;
+	uint64_t	first;
+	uint64_t	words[RNG_STREAM_BLOCK];
+}rng_prefetch_slot_t;
+
+struct rng_prefetch_s
+{
+	// written by the consumer
+	atomic_u64_t			head;			// next ring block to read
+	atomic_u64_t			need;			// first value of the next block the consumer will ask for
+	uint8_t					pad0[RNG_CACHE_LINE - sizeof(atomic_u64_t) * 2];
+	// written by the producer
+	atomic_u64_t			tail;			// next ring block to write
+	atomic_u32_t			waiting;		// set while the producer blocks, or is about to, on "wake"
+	uint8_t					pad1[RNG_CACHE_LINE - sizeof(atomic_u64_t) - sizeof(atomic_u32_t)];
+
+	// target, written by the consumer under "lock"
+	spinlock_t				lock;
+	atomic_u64_t			epoch;			// 0 until the first target
+	uint64_t				key[2];
+	uint64_t				first;
+	atomic_u32_t			stop;
+
+	const rng_backend_t		*backend;
+	rng_prefetch_slot_t		*slots;
+	uint32_t				capacity;		// power of 2
+#if defined(_MSC_VER)
+	HANDLE					thread;
+	SRWLOCK					wake_lock;
+	CONDITION_VARIABLE		wake;
+#else
+	pthread_t				thread;
+	pthread_mutex_t			wake_lock;
+	pthread_cond_t			wake;
+#endif
+
+	// consumer only
+	uint64_t				consumer_epoch;
+	uint64_t				consumer_key[2];
+	uint64_t				next_first;		// first value of the block the producer is expected to deliver next
+	uint64_t				streak;			// blocks taken in order since the last retarget
+	uint64_t				hits;
+	uint64_t				stalls;
+	uint64_t				retargets;
+	uint64_t				discarded;
+};
+
+// Nothing for the producer to do: no target yet, or a full ring.
+static INLINE_DEF int RNG_PrefetchIsIdle(rng_prefetch_t *pf, uint64_t tail)
+{
+	return !ATOMIC_LOAD_ACQ_U64(&pf->epoch) || (tail - ATOMIC_LOAD_ACQ_U64(&pf->head) >= pf->capacity);
+}
+// Blocks the producer until the consumer or RNG_StopPrefetch wakes it.
+static void RNG_PrefetchWait(rng_prefetch_t *pf, uint64_t tail)
+{
+#if defined(_MSC_VER)
+	AcquireSRWLockExclusive(&pf->wake_lock);
+#else
+	pthread_mutex_lock(&pf->wake_lock);
+#endif
+	ATOMIC_STORE_U32(&pf->waiting, 1);
+	ATOMIC_FENCE();
+	while (!ATOMIC_LOAD_U32(&pf->stop) && RNG_PrefetchIsIdle(pf, tail))
+	{
+#if defined(_MSC_VER)
+		SleepConditionVariableSRW(&pf->wake, &pf->wake_lock, INFINITE, 0);
+#else
+		pthread_cond_wait(&pf->wake, &pf->wake_lock);
+#endif
+	}
+	ATOMIC_STORE_U32(&pf->waiting, 0);
+#if defined(_MSC_VER)
+	ReleaseSRWLockExclusive(&pf->wake_lock);
+#else
+	pthread_mutex_unlock(&pf->wake_lock);
+#endif
+}
+// Called by the consumer after it has published a new head or target.
+static void RNG_PrefetchWake(rng_prefetch_t *pf)
+{
+	ATOMIC_FENCE();
+	if (!ATOMIC_LOAD_U32(&pf->waiting))
+		return;
+#if defined(_MSC_VER)
+	AcquireSRWLockExclusive(&pf->wake_lock);
+	WakeConditionVariable(&pf->wake);
+	ReleaseSRWLockExclusive(&pf->wake_lock);
+#else
+	pthread_mutex_lock(&pf->wake_lock);
+	pthread_cond_signal(&pf->wake);
+	pthread_mutex_unlock(&pf->wake_lock);
+#endif
+}
+static void RNG_PrefetchRun(rng_prefetch_t *pf)
+{
+	rng_prefetch_slot_t *slot;
+	uint64_t key[2] = {0, 0};
+	uint64_t epoch = 0;
+	uint64_t next = 0;
+	uint64_t tail = ATOMIC_LOAD_U64(&pf->tail);
+	uint64_t need;
+	uint32_t idle = 0;
+
+	while (!ATOMIC_LOAD_U32(&pf->stop))
+	{
+		if (ATOMIC_LOAD_ACQ_U64(&pf->epoch) != epoch)
+		{
+			SpinLock_Lock(&pf->lock);
+			epoch = ATOMIC_LOAD_U64(&pf->epoch);
+			key[0] = pf->key[0];
+			key[1] = pf->key[1];
+			next = pf->first;
+			SpinLock_Unlock(&pf->lock);
+		}
+
+		if (!epoch || (tail - ATOMIC_LOAD_ACQ_U64(&pf->head) >= pf->capacity))
+		{
+			if (idle++ < RNG_PREFETCH_IDLE_SPINS)
+				CPU_RELAX();
+			else
+				RNG_PrefetchWait(pf, tail);
+			continue;
+		}
+		idle = 0;
+
+		need = ATOMIC_LOAD_U64(&pf->need);
+		if (need > next)
+			next = need;
+
+		slot = &pf->slots[tail & (pf->capacity - 1)];
+		slot->epoch = epoch;
+		slot->first = next;
+		pf->backend->bulk_u64(key, next, slot->words, RNG_STREAM_BLOCK);
+		ATOMIC_STORE_REL_U64(&pf->tail, ++tail);
+		next += RNG_STREAM_BLOCK;
+	}
+}
+#if defined(_MSC_VER)
+static DWORD WINAPI RNG_PrefetchThread(LPVOID arg)
+{
+	RNG_PrefetchRun((rng_prefetch_t*)arg);
+	return 0;
+}
+#else
+static void *RNG_PrefetchThread(void *arg)
+{
+	RNG_PrefetchRun((rng_prefetch_t*)arg);
+	return 0;
+}
+#endif
+
+static void RNG_PrefetchRetarget(rng_prefetch_t *pf, const uint64_t *key, uint64_t first)
+{
+	SpinLock_Lock(&pf->lock);
+	pf->key[0] = key[0];
+	pf->key[1] = key[1];
+	pf->first = first;
+	ATOMIC_STORE_U64(&pf->need, first);
+	ATOMIC_STORE_REL_U64(&pf->epoch, ++pf->consumer_epoch);
+	SpinLock_Unlock(&pf->lock);
+
+	pf->consumer_key[0] = key[0];
+	pf->consumer_key[1] = key[1];
+	pf->next_first = first;
+	pf->streak = 0;
+	pf->retargets++;
+}
+// Copies the stream block starting at value "first" of "key" to "out" if the ring has it. Returns zero if
+// the caller has to compute the block itself.
+static int RNG_PrefetchTake(rng_prefetch_t *pf, const uint64_t *key, uint64_t first, uint64_t *out)
+{
+	rng_prefetch_slot_t *slot;
+	uint64_t head;
+	uint64_t tail;
+	int found = 0;
+
+	if (!pf->consumer_epoch || (first != pf->next_first) || (key[0] != pf->consumer_key[0]) || (key[1] != pf->consumer_key[1]))
+	{
+		RNG_PrefetchRetarget(pf, key, first + RNG_STREAM_BLOCK);
+		return 0;
+	}
+	pf->next_first = first + RNG_STREAM_BLOCK;
+	pf->streak++;
+	ATOMIC_STORE_U64(&pf->need, pf->next_first);
+
+	head = ATOMIC_LOAD_U64(&pf->head);
+	tail = ATOMIC_LOAD_ACQ_U64(&pf->tail);
+	while (head != tail)
+	{
+		slot = &pf->slots[head & (pf->capacity - 1)];
+		if (slot->epoch == pf->consumer_epoch && slot->first > first)
+			break;	// ahead of this block, so it is still needed
+		head++;
+		if (slot->epoch == pf->consumer_epoch && slot->first == first)
+		{
+			memcpy(out, slot->words, sizeof(slot->words));
+			found = 1;
+			break;
+		}
+		pf->discarded++;
+	}
+	ATOMIC_STORE_REL_U64(&pf->head, head);
+	if ((pf->streak >= RNG_PREFETCH_WAKE_BLOCKS) && (tail - head <= pf->capacity / 2))
+		RNG_PrefetchWake(pf);
+
+	if (found)
+		pf->hits++;
+	else
+		pf->stalls++;
+
+	return found;
+}
+
+void RNG_StopPrefetch(rng_t *rng)
+{
+	rng_prefetch_t *pf = rng->mode_data ? rng->mode_data->prefetch : 0;
+
+	if (!pf)
+		return;
+
+	ATOMIC_STORE_U32(&pf->stop, 1);
+#if defined(_MSC_VER)
+	AcquireSRWLockExclusive(&pf->wake_lock);
+	WakeConditionVariable(&pf->wake);
+	ReleaseSRWLockExclusive(&pf->wake_lock);
+	WaitForSingleObject(pf->thread, INFINITE);
+	CloseHandle(pf->thread);
+#else
+	pthread_mutex_lock(&pf->wake_lock);
+	pthread_cond_signal(&pf->wake);
+	pthread_mutex_unlock(&pf->wake_lock);
+	pthread_join(pf->thread, 0);
+	pthread_cond_destroy(&pf->wake);
+	pthread_mutex_destroy(&pf->wake_lock);
+#endif
+	Mem_AlignedFree(pf->slots);
+	Mem_AlignedFree(pf);
+	rng->mode_data->prefetch = 0;
+}
+// Any running prefetcher is replaced. "blocks" is rounded up to a power of 2.
+int RNG_StartPrefetch(rng_t *rng, uint32_t blocks)
+{
+	rng_prefetch_t *pf;
+
+	if (!RNG_IsValid(rng) || blocks > RNG_PREFETCH_MAX_BLOCKS)
+		return -1;
+
+	RNG_StopPrefetch(rng);
+	if (!rng->mode_data)
+	{
+		rng->mode_data = RNG_ModeDataNew(0);
+		if (!rng->mode_data)
+			return -1;
+	}
+
+	if (blocks < RNG_PREFETCH_MIN_BLOCKS)
+		blocks = RNG_PREFETCH_MIN_BLOCKS;
+	blocks = Math_CeilPow2u32(blocks);
+
+	pf = Mem_AlignedMalloc(sizeof(rng_prefetch_t), RNG_CACHE_LINE);
+	if (!pf)
+		return -1;
+	memset(pf, 0, sizeof(rng_prefetch_t));
+	pf->slots = Mem_AlignedMalloc((size_t)blocks * sizeof(rng_prefetch_slot_t), RNG_CACHE_LINE);
+	if (!pf->slots)
+	{
+		Mem_AlignedFree(pf);
+		return -1;
+	}
+	pf->backend = rng->backend;
+	pf->capacity = blocks;
+
+#if defined(_MSC_VER)
+	InitializeSRWLock(&pf->wake_lock);
+	InitializeConditionVariable(&pf->wake);
+	pf->thread = CreateThread(0, 0, RNG_PrefetchThread, pf, 0, 0);
+	if (!pf->thread)
+	{
+		Mem_AlignedFree(pf->slots);
+		Mem_AlignedFree(pf);
+		return -1;
+	}
+#else
+	if (pthread_mutex_init(&pf->wake_lock, 0))
+	{
+		Mem_AlignedFree(pf->slots);
+		Mem_AlignedFree(pf);
+		return -1;
+	}
+	if (pthread_cond_init(&pf->wake, 0))
+	{
+		pthread_mutex_destroy(&pf->wake_lock);
+		Mem_AlignedFree(pf->slots);
+		Mem_AlignedFree(pf);
+		return -1;
+	}
+	if (pthread_create(&pf->thread, 0, RNG_PrefetchThread, pf))
+	{
+		pthread_cond_destroy(&pf->wake);
+		pthread_mutex_destroy(&pf->wake_lock);
+		Mem_AlignedFree(pf->slots);
+		Mem_AlignedFree(pf);
+		return -1;
+	}
+#endif
+
+	rng->mode_data->prefetch = pf;
+
+	return 0;
+}
+int RNG_GetPrefetchStats(rng_t *rng, rng_prefetch_stats_t *stats)
+{
+	rng_prefetch_t *pf = rng->mode_data ? rng->mode_data->prefetch : 0;
+
+	memset(stats, 0, sizeof(rng_prefetch_stats_t));
+	if (!pf)
+		return -1;
+
+	stats->capacity = pf->capacity;
+	stats->fill_level = (uint32_t)(ATOMIC_LOAD_ACQ_U64(&pf->tail) - ATOMIC_LOAD_U64(&pf->head));
+	stats->hits = pf->hits;
+	stats->stalls = pf->stalls;
+	stats->retargets = pf->retargets;
+	stats->discarded = pf->discarded;
+
+	return 0;
+}
+
+/*
+	Chunk digest tree of RNG_LAYOUT_TREE.
+
+	Leaf i is the backend hash of state bytes [i * RNG_TREE_LEAF, (i + 1) * RNG_TREE_LEAF) with seed i, the
+	last leaf being partial. Node j of level l > 0 is the hash of the digests of children
+	[j * RNG_TREE_FANOUT, (j + 1) * RNG_TREE_FANOUT) of level l - 1 with seed (l << 56) | j. The first level
+	with a single node holds the root, and the state hash with seed s is the hash of (root, state size)
+	with seed s. Changing a byte dirties one leaf, and the next hash recomputes only the dirty leaves and
+	their ancestors.
+*/
+typedef struct rng_tree_s
+{
+	uint32_t	levels;								// levels allocated for leaf_capacity leaves
+	uint32_t	leaf_capacity;
+	uint32_t	leaf_count;							// leaves at the last update
+	uint64_t	*digest[RNG_TREE_MAX_LEVELS];		// node j of level l is digest[l][2 * j] (low), digest[l][2 * j + 1]
+	uint64_t	*dirty[RNG_TREE_MAX_LEVELS];		// bit j of level l: node j must be recomputed
+}rng_tree_t;
+
+static INLINE_DEF void RNG_TreeMark(uint64_t *bits, uint32_t first, uint32_t end)
+{
+	for (; first < end; first++)
+		bits[first >> 6] |= ((uint64_t)1) << (first & 63);
+}
+// Marks the leaves holding state bytes [begin, end) dirty; "end" may run past the end of the tree.
+static INLINE_DEF void RNG_TreeDirty(rng_tree_t *tree, uint32_t begin, uint32_t end)
+{
+	uint32_t last = (end - 1) / RNG_TREE_LEAF;
+
+	if (end <= begin)
+		return;
+	if (last >= tree->leaf_capacity)
+		last = tree->leaf_capacity - 1;
+
+	RNG_TreeMark(tree->dirty[0], begin / RNG_TREE_LEAF, last + 1);
+}
+
+// Drops every checkpoint that covers state bytes at or above "offset", and marks tree leaves holding bytes
+// in [offset, end) dirty. Must be called by anything that modifies or removes state bytes.
+static INLINE_DEF void RNG_InvalidateRange(rng_t *rng, uint32_t offset, uint32_t end)
+{
+	if (rng->checkpoint_count > offset / RNG_CHECKPOINT_INTERVAL)
+		rng->checkpoint_count = offset / RNG_CHECKPOINT_INTERVAL;
+	if (rng->tree)
+		RNG_TreeDirty((rng_tree_t*)rng->tree, offset, end);
+
+	if (rng->mode_data)
+	{
+		rng->mode_data->reservoir_bits = 0;
+		rng->mode_data->reservoir_seed = 0;
+		rng->mode_data->stream_position = 0;
+	}
+	rng->flags &= ~(RNG_FLAG_STREAM_KEY | RNG_FLAG_DIGEST);
+
+	rng->generation++;
+	if (rng->digests)
+		rng->digests->valid = 0;
+}
+static INLINE_DEF void RNG_InvalidateState(rng_t *rng, uint32_t offset)
+{
+	RNG_InvalidateRange(rng, offset, UINT32_MAX);
+}
+
+// Checkpoint storage holds "count" backend stream states plus one scratch state at index checkpoint_capacity.
+static int RNG_ReserveCheckpoints(rng_t *rng, uint32_t count)
+{
+	size_t stride = RNG_CheckpointStride(rng->backend);
+	size_t align = rng->backend->stream_state_align > RNG_CHECKPOINT_ALIGN ? rng->backend->stream_state_align : RNG_CHECKPOINT_ALIGN;
+	uint8_t *ptr;
+
+	if (count <= rng->checkpoint_capacity)
+		return 0;
+
+	count = Math_CeilPow2u32(count);
+	ptr = Mem_AlignedMalloc((count + 1) * stride, align);
+	if (!ptr)
+		return -1;
+
+	if (rng->checkpoint_count)
+		memcpy(ptr, rng->checkpoints, rng->checkpoint_count * stride);
+	Mem_AlignedFree(rng->checkpoints);
+
+	rng->checkpoints = ptr;
+	rng->checkpoint_capacity = count;
+
+	return 0;
+}
+
+// Hash of the whole state with seed 0, bit-identical to the one-shot hash of the backend. Large states
+// resume from the deepest valid checkpoint, and checkpoints are laid down for every complete interval
+// absorbed on the way.
+static XXH128_hash_t RNG_StateHash128(rng_t *rng)
+{
+	const rng_backend_t *backend = rng->backend;
+	XXH128_hash_t h;
+	uint64_t out[2];
+	uint8_t *checkpoints;
+	uint8_t *ctx;
+	size_t stride;
+	uint32_t offset;
+	uint32_t k;
+
+	if ((rng->state_size < RNG_CHECKPOINT_MIN_SIZE) || !backend->stream_reset || RNG_ReserveCheckpoints(rng, rng->state_size / RNG_CHECKPOINT_INTERVAL))
+	{
+		RNG_STAT_HASH(rng, rng->state_size);
+		return RNG_BackendHash128(backend, RNG_StateData(rng), rng->state_size, 0);
+	}
+
+	stride = RNG_CheckpointStride(backend);
+	checkpoints = (uint8_t*)rng->checkpoints;
+	ctx = &checkpoints[rng->checkpoint_capacity * stride];
+	k = rng->checkpoint_count;
+
+	if (k)
+		memcpy(ctx, &checkpoints[(k - 1) * stride], stride);
+	else
+		backend->stream_reset(ctx, 0);
+	RNG_STAT_HASH(rng, rng->state_size - k * RNG_CHECKPOINT_INTERVAL);
+
+	for (offset = k * RNG_CHECKPOINT_INTERVAL; offset + RNG_CHECKPOINT_INTERVAL <= rng->state_size; offset += RNG_CHECKPOINT_INTERVAL)
+	{
+		backend->stream_update(ctx, &RNG_StateData(rng)[offset], RNG_CHECKPOINT_INTERVAL);
+		memcpy(&checkpoints[k++ * stride], ctx, stride);
+	}
+	rng->checkpoint_count = k;
+
+	backend->stream_update(ctx, &RNG_StateData(rng)[offset], rng->state_size - offset);
+	backend->stream_digest(ctx, out);
+
+	h.low64 = out[0];
+	h.high64 = out[1];
+
+	return h;
+}
+
+// Nodes per level for "leaves" leaves; returns the number of levels, root level included.
+static uint32_t RNG_TreeShape(uint32_t leaves, uint32_t *count)
+{
+	uint32_t levels = 0;
+
+	count[levels++] = leaves;
+	while (count[levels - 1] > 1)
+	{
+		count[levels] = (count[levels - 1] + RNG_TREE_FANOUT - 1) / RNG_TREE_FANOUT;
+		levels++;
+	}
+
+	return levels;
+}
+// Allocates a tree for "capacity" leaves in one block, with every node dirty.
+static rng_tree_t *RNG_TreeAlloc(uint32_t capacity)
+{
+	uint32_t count[RNG_TREE_MAX_LEVELS];
+	uint32_t levels = RNG_TreeShape(capacity, count);
+	size_t digest_words = 0;
+	size_t dirty_words = 0;
+	rng_tree_t *tree;
+	uint64_t *ptr;
+	uint32_t l;
+
+	for (l = 0; l < levels; l++)
+	{
+		digest_words += (size_t)count[l] * 2;
+		dirty_words += (count[l] + 63) / 64;
+	}
+
+	tree = MALLOC_FUNC(sizeof(rng_tree_t) + (digest_words + dirty_words) * sizeof(uint64_t));
+	if (!tree)
+		return 0;
+
+	tree->levels = levels;
+	tree->leaf_capacity = capacity;
+	tree->leaf_count = 0;
+
+	ptr = (uint64_t*)(tree + 1);
+	for (l = 0; l < levels; l++)
+	{
+		tree->digest[l] = ptr;
+		ptr += (size_t)count[l] * 2;
+	}
+	for (l = 0; l < levels; l++)
+	{
+		tree->dirty[l] = ptr;
+		memset(ptr, 0xFF, ((count[l] + 63) / 64) * sizeof(uint64_t));
+		ptr += (count[l] + 63) / 64;
+	}
+
+	return tree;
+}
+// "rng", if not NULL, is the RNG the hash is counted against in the stats; the same goes for the other tree functions.
+static INLINE_DEF void RNG_TreeHash(rng_t *rng, const rng_backend_t *backend, const void *data, size_t len, uint64_t seed, uint64_t *out)
+{
+	XXH128_hash_t h = RNG_BackendHash128(backend, data, len, seed);
+
+	RNG_STAT_HASH(rng, len);
+
+	out[0] = h.low64;
+	out[1] = h.high64;
+}
+static INLINE_DEF uint64_t RNG_TreeNodeSeed(uint32_t level, uint32_t index)
+{
+	return (((uint64_t)level) << 56) | index;
+}
+
+// Brings the tree of the RNG up to date and stores its root. Returns non-zero if the tree cannot be
+// allocated.
+static int RNG_TreeRoot(rng_t *rng, uint64_t *root)
+{
+	const rng_backend_t *backend = rng->backend;
+	rng_tree_t *tree = (rng_tree_t*)rng->tree;
+	uint32_t leaves = (rng->state_size + RNG_TREE_LEAF - 1) / RNG_TREE_LEAF;
+	uint32_t count[RNG_TREE_MAX_LEVELS];
+	uint32_t levels = RNG_TreeShape(leaves, count);
+	uint32_t level;
+	uint32_t words;
+	uint32_t first;
+	uint32_t k;
+	uint32_t i;
+	uint64_t w;
+
+	if (!tree || (tree->leaf_capacity < leaves))
+	{
+		FREE_FUNC(tree);
+		tree = RNG_TreeAlloc(Math_CeilPow2u32(leaves));
+		rng->tree = tree;
+		if (!tree)
+			return -1;
+	}
+
+	// the last leaf, and with it the last node of every level, changes shape when the leaf count does
+	if (leaves != tree->leaf_count)
+	{
+		first = leaves < tree->leaf_count ? leaves : tree->leaf_count;
+		RNG_TreeMark(tree->dirty[0], first ? first - 1 : 0, leaves);
+		tree->leaf_count = leaves;
+	}
+
+	for (level = 0; level < levels; level++)
+	{
+		words = (count[level] + 63) / 64;
+		for (k = 0; k < words; k++)
+		{
+			w = tree->dirty[level][k];
+			if ((k == words - 1) && (count[level] & 63))
+				w &= (((uint64_t)1) << (count[level] & 63)) - 1;
+			tree->dirty[level][k] &= ~w;
+
+			for (; w; w &= w - 1)
+			{
+				i = k * 64 + (uint32_t)Math_PopCnt64((w & (~w + 1)) - 1);
+
+				if (level == 0)
+				{
+					RNG_TreeHash(rng, backend, &RNG_StateData(rng)[(size_t)i * RNG_TREE_LEAF],
+						(rng->state_size - i * RNG_TREE_LEAF) < RNG_TREE_LEAF ? rng->state_size - i * RNG_TREE_LEAF : RNG_TREE_LEAF,
+						i, &tree->digest[0][2 * i]);
+				}
+				else
+				{
+					uint32_t children = count[level - 1] - i * RNG_TREE_FANOUT;
+
+					if (children > RNG_TREE_FANOUT)
+						children = RNG_TREE_FANOUT;
+					RNG_TreeHash(rng, backend, &tree->digest[level - 1][2 * i * RNG_TREE_FANOUT], (size_t)children * 2 * sizeof(uint64_t),
+						RNG_TreeNodeSeed(level, i), &tree->digest[level][2 * i]);
+				}
+
+				if (level + 1 < levels)
+					tree->dirty[level + 1][(i / RNG_TREE_FANOUT) >> 6] |= ((uint64_t)1) << ((i / RNG_TREE_FANOUT) & 63);
+			}
+		}
+	}
+
+	root[0] = tree->digest[levels - 1][0];
+	root[1] = tree->digest[levels - 1][1];
+
+	return 0;
+}
+
+// Root of the tree over the concatenation of "a" and "b", computed from scratch, left to right, with one
+// partial node per level on the stack. Used where the RNG's own tree cannot be used or updated.
+static void RNG_TreeRootSegments(rng_t *rng, const rng_backend_t *backend, const uint8_t *a, size_t alen, const uint8_t *b, size_t blen, uint64_t *root)
+{
+	uint64_t pending[RNG_TREE_MAX_LEVELS][RNG_TREE_FANOUT * 2];
+	uint32_t filled[RNG_TREE_MAX_LEVELS];
+	uint32_t next[RNG_TREE_MAX_LEVELS];
+	uint32_t count[RNG_TREE_MAX_LEVELS];
+	uint8_t leaf[RNG_TREE_LEAF];
+	size_t size = alen + blen;
+	uint32_t leaves = (uint32_t)((size + RNG_TREE_LEAF - 1) / RNG_TREE_LEAF);
+	uint32_t levels = RNG_TreeShape(leaves, count);
+	uint64_t digest[2];
+	const uint8_t *p;
+	size_t offset;
+	size_t len;
+	uint32_t level;
+	uint32_t i;
+	uint32_t j;
+
+	memset(filled, 0, sizeof(filled));
+	memset(next, 0, sizeof(next));
+
+	for (i = 0; i < leaves; i++)
+	{
+		offset = (size_t)i * RNG_TREE_LEAF;
+		len = size - offset < RNG_TREE_LEAF ? size - offset : RNG_TREE_LEAF;
+		if (offset + len <= alen)
+			p = &a[offset];
+		else if (offset >= alen)
+			p = &b[offset - alen];
+		else
+		{
+			memcpy(leaf, &a[offset], alen - offset);
+			memcpy(&leaf[alen - offset], b, len - (alen - offset));
+			p = leaf;
+		}
+		RNG_TreeHash(rng, backend, p, len, i, digest);
+
+		// carry the digest up through every node it completes
+		for (level = 0; level + 1 < levels; level++)
+		{
+			pending[level][2 * filled[level]] = digest[0];
+			pending[level][2 * filled[level] + 1] = digest[1];
+			filled[level]++;
+			if ((filled[level] < RNG_TREE_FANOUT) && (++next[level] < count[level]))
+				break;
+			if (filled[level] == RNG_TREE_FANOUT)
+				next[level]++;
+
+			j = (next[level] - 1) / RNG_TREE_FANOUT;
+			RNG_TreeHash(rng, backend, pending[level], (size_t)filled[level] * 2 * sizeof(uint64_t), RNG_TreeNodeSeed(level + 1, j), digest);
+			filled[level] = 0;
+		}
+		if (level + 1 == levels)
+		{
+			root[0] = digest[0];
+			root[1] = digest[1];
+		}
+	}
+}
+
+// Root of the RNG's up-to-date tree with the 8 state bytes at "pos" replaced by "key", without changing the
+// tree: the one or two leaves holding the slot are rehashed, then only their ancestors.
+static void RNG_TreeRootPatched(rng_t *rng, uint32_t pos, const uint64_t *key, uint64_t *root)
+{
+	const rng_backend_t *backend = rng->backend;
+	rng_tree_t *tree = (rng_tree_t*)rng->tree;
+	uint32_t count[RNG_TREE_MAX_LEVELS];
+	uint32_t levels = RNG_TreeShape(tree->leaf_count, count);
+	uint64_t children[RNG_TREE_FANOUT * 2];
+	uint64_t digest[2][2];
+	uint32_t index[2];
+	uint8_t leaf[RNG_TREE_LEAF];
+	uint32_t changed = 0;
+	uint32_t level;
+	uint32_t first;
+	uint32_t len;
+	uint32_t c;
+	uint32_t i;
+	uint32_t j;
+	uint32_t n;
+
+	for (i = pos / RNG_TREE_LEAF; i <= (pos + (uint32_t)sizeof(uint64_t) - 1) / RNG_TREE_LEAF; i++)
+	{
+		first = i * RNG_TREE_LEAF;
+		len = rng->state_size - first < RNG_TREE_LEAF ? rng->state_size - first : RNG_TREE_LEAF;
+		memcpy(leaf, &RNG_StateData(rng)[first], len);
+		for (j = 0; j < sizeof(uint64_t); j++)
+		{
+			if ((pos + j >= first) && (pos + j < first + len))
+				leaf[pos + j - first] = ((const uint8_t*)key)[j];
+		}
+		RNG_TreeHash(rng, backend, leaf, len, i, digest[changed]);
+		index[changed++] = i;
+	}
+
+	for (level = 1; level < levels; level++)
+	{
+		n = 0;
+		for (c = 0; c < changed; c++)
+		{
+			j = index[c] / RNG_TREE_FANOUT;
+			if (n && (index[n - 1] == j))
+				continue; // sibling of the previous change, already folded into its parent
+
+			len = count[level - 1] - j * RNG_TREE_FANOUT;
+			if (len > RNG_TREE_FANOUT)
+				len = RNG_TREE_FANOUT;
+			memcpy(children, &tree->digest[level - 1][2 * j * RNG_TREE_FANOUT], (size_t)len * 2 * sizeof(uint64_t));
+			for (i = c; (i < changed) && (index[i] / RNG_TREE_FANOUT == j); i++)
+			{
+				children[2 * (index[i] - j * RNG_TREE_FANOUT)] = digest[i][0];
+				children[2 * (index[i] - j * RNG_TREE_FANOUT) + 1] = digest[i][1];
+			}
+
+			RNG_TreeHash(rng, backend, children, (size_t)len * 2 * sizeof(uint64_t), RNG_TreeNodeSeed(level, j), digest[n]);
+			index[n++] = j;
+		}
+		changed = n;
+	}
+
+	root[0] = digest[0][0];
+	root[1] = digest[0][1];
+}
+
+// State hash with "seed" in RNG_LAYOUT_TREE, from the root and the state size.
+static INLINE_DEF XXH128_hash_t RNG_TreeFinal(rng_t *rng, const rng_backend_t *backend, const uint64_t *root, uint64_t size, uint64_t seed)
+{
+	uint64_t input[3];
+
+	input[0] = root[0];
+	input[1] = root[1];
+	input[2] = size;
+	RNG_STAT_HASH(rng, sizeof(input));
+
+	return RNG_BackendHash128(backend, input, sizeof(input), seed);
+}
+
+// Hash of the state with "seed", ignoring the digest caches.
+static INLINE_DEF XXH128_hash_t RNG_StateDigestUncached(rng_t *rng, uint64_t seed)
+{
+	if (rng->layout == RNG_LAYOUT_TREE)
+	{
+		uint64_t root[2];
+
+		if (RNG_TreeRoot(rng, root))
+			RNG_TreeRootSegments(rng, rng->backend, RNG_StateData(rng), rng->state_size, 0, 0, root);
+		return RNG_TreeFinal(rng, rng->backend, root, rng->state_size, seed);
+	}
+	if (seed == 0)
+		return RNG_StateHash128(rng);
+
+	RNG_STAT_HASH(rng, rng->state_size);
+	return RNG_BackendHash128(rng->backend, RNG_StateData(rng), rng->state_size, seed);
+}
+// Hash of the state with a non-zero "seed". Seeds below RNG_DIGEST_CACHE are cached in rng->digests, which
+// is only allocated for states larger than inline_state.
+static INLINE_DEF XXH128_hash_t RNG_StateDigestSeeded(rng_t *rng, uint64_t seed)
+{
+	rng_digest_cache_t *cache = rng->digests;
+	XXH128_hash_t h;
+
+	if (seed >= RNG_DIGEST_CACHE)
+		return RNG_StateDigestUncached(rng, seed);
+	if (cache && (cache->valid & (1u << seed)))
+	{
+		h.low64 = cache->digest[seed - 1][0];
+		h.high64 = cache->digest[seed - 1][1];
+		return h;
+	}
+
+	h = RNG_StateDigestUncached(rng, seed);
+
+	if (!cache && (rng->state_size > RNG_INLINE_STATE_SIZE))
+	{
+		cache = MALLOC_FUNC(sizeof(rng_digest_cache_t));
+		if (cache)
+			cache->valid = 0;
+		rng->digests = cache;
+	}
+	if (cache)
+	{
+		cache->digest[seed - 1][0] = h.low64;
+		cache->digest[seed - 1][1] = h.high64;
+		cache->valid |= 1u << seed;
+	}
+
+	return h;
+}
+// Hash of the state with "seed". The first RNG_DIGEST_CACHE seeds are cached until the next change to the
+// state, so repeated reads of an unchanged stack (say a Randomf32 followed by a Randomu32) hash it once.
+// Seed 0 is kept in the rng_t itself.
+static INLINE_DEF XXH128_hash_t RNG_StateDigest128(rng_t *rng, uint64_t seed)
+{
+	XXH128_hash_t h;
+
+	if (seed)
+		return RNG_StateDigestSeeded(rng, seed);
+	if (rng->flags & RNG_FLAG_DIGEST)
+	{
+		h.low64 = rng->digest[0];
+		h.high64 = rng->digest[1];
+		return h;
+	}
+
+	h = RNG_StateDigestUncached(rng, 0);
+	rng->digest[0] = h.low64;
+	rng->digest[1] = h.high64;
+	rng->flags |= RNG_FLAG_DIGEST;
+
+	return h;
+}
+
+static INLINE_DEF uint64_t RNG_StateHash64(rng_t *rng, uint64_t seed)
+{
+	return RNG_StateDigest128(rng, seed).low64;
+}
+
+// Absorbs "blocks" whole XXH3 blocks into one seed's accumulators. Kept out of line so that the
+// accumulators stay in registers for the whole span.
+static void RNG_XXH3_Blocks(xxh_u64 *XXH_RESTRICT lane_acc, const uint8_t *XXH_RESTRICT input, const xxh_u8 *XXH_RESTRICT secret, size_t blocks)
+{
+	const size_t stripes_per_block = (XXH_SECRET_DEFAULT_SIZE - XXH_STRIPE_LEN) / XXH_SECRET_CONSUME_RATE;
+	XXH_ALIGN(XXH_ACC_ALIGN) xxh_u64 acc[XXH_ACC_NB];
+	size_t b;
+
+	memcpy(acc, lane_acc, sizeof(acc));
+	for (b = 0; b < blocks; b++)
+	{
+		XXH3_accumulate(acc, &input[b * XXH_STRIPE_LEN * stripes_per_block], secret, stripes_per_block, XXH3_accumulate_512);
+		XXH3_scrambleAcc(acc, &secret[XXH_SECRET_DEFAULT_SIZE - XXH_STRIPE_LEN]);
+	}
+	memcpy(lane_acc, acc, sizeof(acc));
+}
+
+// XXH128(input, len, seed + i).low64 for "count" (at most RNG_MULTI_LANES) seeds and len > XXH3_MIDSIZE_MAX.
+// This is XXH3_hashLong_128b_withSeed with the seeds run side by side: every span of input is loaded once
+// and then absorbed by each seed while it is still in L1, so the input is swept once rather than once per
+// seed. Dispatched builds use the baseline vector kernel here.
+static void RNG_XXH3_LongN(const uint8_t *input, size_t len, uint64_t seed, uint32_t count, uint64_t *out)
+{
+	static const xxh_u64 init_acc[XXH_ACC_NB] = XXH3_INIT_ACC;
+	const size_t stripes_per_block = (XXH_SECRET_DEFAULT_SIZE - XXH_STRIPE_LEN) / XXH_SECRET_CONSUME_RATE;
+	const size_t block_len = XXH_STRIPE_LEN * stripes_per_block;
+	const size_t blocks = (len - 1) / block_len;
+	const size_t last_stripes = ((len - 1) - block_len * blocks) / XXH_STRIPE_LEN;
+	XXH_ALIGN(XXH_ACC_ALIGN) xxh_u64 acc[RNG_MULTI_LANES][XXH_ACC_NB];
+	XXH_ALIGN(XXH_SEC_ALIGN) xxh_u8 secret[RNG_MULTI_LANES][XXH_SECRET_DEFAULT_SIZE];
+	size_t span;
+	size_t b;
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		memcpy(acc[i], init_acc, sizeof(init_acc));
+		XXH3_initCustomSecret(secret[i], seed + i);
+	}
+
+	for (b = 0; b < blocks; b += span)
+	{
+		span = blocks - b < RNG_MULTI_SPAN ? blocks - b : RNG_MULTI_SPAN;
+		for (i = 0; i < count; i++)
+			RNG_XXH3_Blocks(acc[i], &input[b * block_len], secret[i], span);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		XXH3_accumulate(acc[i], &input[blocks * block_len], secret[i], last_stripes, XXH3_accumulate_512);
+		XXH3_accumulate_512(acc[i], &input[len - XXH_STRIPE_LEN], &secret[i][XXH_SECRET_DEFAULT_SIZE - XXH_STRIPE_LEN - XXH_SECRET_LASTACC_START]);
+		out[i] = XXH3_mergeAccs(acc[i], &secret[i][XXH_SECRET_MERGEACCS_START], (xxh_u64)len * XXH_PRIME64_1);
+	}
+}
+
+// out[i] = RNG_StateHash64(rng, seed + i), with long XXH3 states hashed RNG_MULTI_LANES seeds per pass.
+// Seed 0 still goes through the checkpoints when any are valid, since it then only needs the tail.
+static void RNG_StateDigestN(rng_t *rng, uint64_t seed, uint32_t count, uint64_t *out)
+{
+	uint32_t n;
+	uint32_t i;
+
+	if ((rng->state_size <= XXH3_MIDSIZE_MAX) || (rng->backend->hash128 != RNG_XXH3_Hash128) || (rng->layout != RNG_LAYOUT_FLAT))
+	{
+		for (i = 0; i < count; i++)
+			out[i] = RNG_StateHash64(rng, seed + i);
+		return;
+	}
+
+	if ((seed == 0) && count && rng->checkpoint_count)
+	{
+		*out++ = RNG_StateHash64(rng, seed++);
+		count--;
+	}
+
+	for (i = 0; i < count; i += n)
+	{
+		n = count - i < RNG_MULTI_LANES ? count - i : RNG_MULTI_LANES;
+		RNG_XXH3_LongN(RNG_StateData(rng), rng->state_size, seed + i, n, &out[i]);
+		RNG_STAT_ADD(rng, hash_calls, n);
+		RNG_STAT_ADD(rng, hash_bytes, (uint64_t)n * rng->state_size);
+	}
+}
+
+// Takes "nbits" (1 to 64) bits from the reservoir. Reservoir bits are the low "reservoir_bits" bits of
+// reservoir[1]:reservoir[0], consumed from the bottom. When it runs dry the reservoir is refilled with the
+// full 128-bit hash of the state under the next seed, so the sequence restarts at seed 0 whenever the
+// state changes.
+static INLINE_DEF uint64_t RNG_ReservoirTake(rng_t *rng, uint32_t nbits)
+{
+	rng_mode_data_t *md = rng->mode_data;
+	uint64_t value = 0;
+	uint64_t chunk;
+	uint32_t got = 0;
+	uint32_t need;
+
+	if (md->reservoir_bits < nbits)
+	{
+		XXH128_hash_t h;
+
+		got = md->reservoir_bits;
+		if (got)
+			value = md->reservoir[0] & ((((uint64_t)1) << got) - 1);
+
+		h = RNG_StateDigest128(rng, md->reservoir_seed++);
+		md->reservoir[0] = h.low64;
+		md->reservoir[1] = h.high64;
+		md->reservoir_bits = RNG_HASH_BITS * 2;
+	}
+
+	need = nbits - got;
+	if (need == RNG_HASH_BITS)
+	{
+		chunk = md->reservoir[0];
+		md->reservoir[0] = md->reservoir[1];
+		md->reservoir[1] = 0;
+	}
+	else
+	{
+		chunk = md->reservoir[0] & ((((uint64_t)1) << need) - 1);
+		md->reservoir[0] = (md->reservoir[0] >> need) | (md->reservoir[1] << (RNG_HASH_BITS - need));
+		md->reservoir[1] >>= need;
+	}
+	md->reservoir_bits -= need;
+
+	return value | (chunk << got);
+}
+
+// Stream value p is bulk_u64(seed 0 state hash, p), the same as element p of RNG_Fillu64. Values are made
+// RNG_STREAM_BLOCK at a time, and the position restarts at 0 whenever the state changes.
+static void RNG_StreamRefill(rng_t *rng)
+{
+	rng_mode_data_t *md = rng->mode_data;
+	XXH128_hash_t h;
+
+	if (!(rng->flags & RNG_FLAG_STREAM_KEY))
+	{
+		h = RNG_StateDigest128(rng, 0);
+		md->stream_key[0] = h.low64;
+		md->stream_key[1] = h.high64;
+		rng->flags |= RNG_FLAG_STREAM_KEY;
+	}
+
+	md->stream_block_first = md->stream_position & ~(uint64_t)(RNG_STREAM_BLOCK - 1);
+	if (md->prefetch && RNG_PrefetchTake(md->prefetch, md->stream_key, md->stream_block_first, md->stream_block))
+		return;
+	rng->backend->bulk_u64(md->stream_key, md->stream_block_first, md->stream_block, RNG_STREAM_BLOCK);
+}
+static INLINE_DEF uint64_t RNG_StreamNext(rng_t *rng)
+{
+	rng_mode_data_t *md = rng->mode_data;
+	uint64_t index = md->stream_position - md->stream_block_first;
+
+	if (!(rng->flags & RNG_FLAG_STREAM_KEY) || (index >= RNG_STREAM_BLOCK))
+	{
+		RNG_StreamRefill(rng);
+		index = md->stream_position - md->stream_block_first;
+	}
+	md->stream_position++;
+
+	return md->stream_block[index];
+}
+
+// Source of raw bits for the integer functions: the seed 0 hash in stateless mode, the reservoir, or the
+// next stream value.
+static INLINE_DEF uint64_t RNG_NextBits(rng_t *rng, uint32_t nbits)
+{
+	if (rng->mode == RNG_MODE_RESERVOIR)
+		return RNG_ReservoirTake(rng, nbits);
+	else if (rng->mode == RNG_MODE_STREAM)
+		return RNG_StreamNext(rng);
+	else
+		return RNG_StateHash64(rng, 0);
+}
+
+// Reservoir floats count zero bits one at a time for the exponent (two bits on average) and then take
+// exactly as many mantissa bits as the format needs, which gives the same distribution as the stateless
+// leading-zero construction.
+static INLINE_DEF uint32_t RNG_ReservoirExponent(rng_t *rng, uint32_t max_pw2)
+{
+	uint32_t pw2 = 0;
+
+	while ((pw2 < max_pw2) && !RNG_ReservoirTake(rng, 1))
+		pw2++;
+
+	return pw2;
+}
+static float RNG_ReservoirFloat32(rng_t *rng)
+{
+	const uint32_t max_pw2 = (1 << (FP32_EXPONENT_BITS - 1)) - 2;
+	uint32_t pw2 = RNG_ReservoirExponent(rng, max_pw2);
+	uint32_t m;
+	float f;
+
+	m = (pw2 < max_pw2) ? (max_pw2 - pw2) << FP32_MANTISSA_BITS : 0;
+	m |= (uint32_t)RNG_ReservoirTake(rng, FP32_MANTISSA_BITS);
+
+	memcpy(&f, &m, sizeof(float));
+
+	return f;
+}
+static double RNG_ReservoirFloat64(rng_t *rng)
+{
+	const uint32_t max_pw2 = (1 << (FP64_EXPONENT_BITS - 1)) - 2;
+	uint32_t pw2 = RNG_ReservoirExponent(rng, max_pw2);
+	uint64_t m;
+	double d;
+
+	m = (pw2 < max_pw2) ? ((uint64_t)(max_pw2 - pw2)) << FP64_MANTISSA_BITS : 0;
+	m |= RNG_ReservoirTake(rng, FP64_MANTISSA_BITS);
+
+	memcpy(&d, &m, sizeof(double));
+
+	return d;
+}
+
+/*
+	Interned IDs.
+
+	Equal IDs share one record, found through a chained hash table under g_rng_id_lock. An RNG with an
+	interned ID stores only the 128-bit digest of the ID bytes in its state, so the state size and the
+	per-call hashing cost do not depend on the length of the ID. A record whose count has dropped to zero
+	is never handed out again, and is unlinked and freed by the thread that released it.
+*/
+struct rng_id_s
+{
+	struct rng_id_s	*next;
+	atomic_u32_t	refs;
+	uint32_t		type;					// RNG_ID_TYPE_STRING or RNG_ID_TYPE_GENERIC
+	uint32_t		length;					// bytes in data, without a terminating NULL
+	uint64_t		hash;					// table key
+	uint64_t		digest[2];				// what RNG_SetIDInterned stores in the state
+	uint8_t			data[];
+};
+
+static rng_id_t **g_rng_id_table = 0;
+static uint32_t g_rng_id_buckets = 0;
+static uint32_t g_rng_id_count = 0;
+
+// Doubles the bucket count. Called with g_rng_id_lock held; on failure the table just stays denser.
+static void RNG_IDTableGrow(void)
+{
+	uint32_t buckets = g_rng_id_buckets ? g_rng_id_buckets * 2 : RNG_ID_TABLE_MIN;
+	rng_id_t **table = MALLOC_FUNC(buckets * sizeof(rng_id_t*));
+	rng_id_t *id;
+	rng_id_t *next;
+	uint32_t i;
+
+	if (!table)
+		return;
+	memset(table, 0, buckets * sizeof(rng_id_t*));
+
+	for (i = 0; i < g_rng_id_buckets; i++)
+	{
+		for (id = g_rng_id_table[i]; id; id = next)
+		{
+			next = id->next;
+			id->next = table[id->hash & (buckets - 1)];
+			table[id->hash & (buckets - 1)] = id;
+		}
+	}
+
+	FREE_FUNC(g_rng_id_table);
+	g_rng_id_table = table;
+	g_rng_id_buckets = buckets;
+}
+// Takes a reference to a record found in the table, unless its count has already dropped to zero: the
+// releasing thread decrements outside g_rng_id_lock, and will unlink and free the record once it gets the lock.
+static INLINE_DEF int RNG_IDTryRef(rng_id_t *id)
+{
+	uint32_t refs = ATOMIC_LOAD_U32(&id->refs);
+
+	while (refs)
+	{
+		if (ATOMIC_CAS_U32(&id->refs, refs, refs + 1))
+			return 1;
+		refs = ATOMIC_LOAD_U32(&id->refs);
+	}
+
+	return 0;
+}
+static rng_id_t *RNG_InternIDType(const void *data, uint32_t data_len, uint32_t type)
+{
+	uint64_t hash = XXH3_64bits_withSeed(data, data_len, type);
+	XXH128_hash_t digest;
+	rng_id_t *id;
+
+	RNG_Lock(&g_rng_id_lock);
+
+	if (g_rng_id_count >= g_rng_id_buckets)
+		RNG_IDTableGrow();
+	if (!g_rng_id_buckets)
+	{
+		SpinLock_Unlock(&g_rng_id_lock);
+		return 0;
+	}
+
+	for (id = g_rng_id_table[hash & (g_rng_id_buckets - 1)]; id; id = id->next)
+	{
+		if ((id->hash == hash) && (id->type == type) && (id->length == data_len) && !memcmp(id->data, data, data_len) && RNG_IDTryRef(id))
+		{
+			SpinLock_Unlock(&g_rng_id_lock);
+			return id;
+		}
+	}
+
+	id = MALLOC_FUNC(sizeof(rng_id_t) + data_len);
+	if (id)
+	{
+		ATOMIC_STORE_U32(&id->refs, 1);
+		id->type = type;
+		id->length = data_len;
+		id->hash = hash;
+		digest = XXH128(data, data_len, RNG_ID_DIGEST_SEED);
+		RNG_STAT_HASH(0, data_len);
+		id->digest[0] = digest.low64;
+		id->digest[1] = digest.high64;
+		memcpy(id->data, data, data_len);
+
+		id->next = g_rng_id_table[hash & (g_rng_id_buckets - 1)];
+		g_rng_id_table[hash & (g_rng_id_buckets - 1)] = id;
+		g_rng_id_count++;
+	}
+
+	SpinLock_Unlock(&g_rng_id_lock);
+
+	return id;
+}
+rng_id_t *RNG_InternID(const void *data, uint32_t data_len)
+{
+	return RNG_InternIDType(data, data_len, RNG_ID_TYPE_GENERIC);
+}
+rng_id_t *RNG_InternIDString(const char *string)
+{
+	return RNG_InternIDType(string, (uint32_t)strlen(string), RNG_ID_TYPE_STRING);
+}
+void RNG_ReleaseID(rng_id_t *id)
+{
+	rng_id_t **link;
+
+	if (!id || (ATOMIC_FETCH_SUB_U32(&id->refs, 1) != 1))
+		return;
+
+	RNG_Lock(&g_rng_id_lock);
+	for (link = &g_rng_id_table[id->hash & (g_rng_id_buckets - 1)]; *link != id; link = &(*link)->next);
+	*link = id->next;
+	g_rng_id_count--;
+	SpinLock_Unlock(&g_rng_id_lock);
+
+	FREE_FUNC(id);
+}
+
+void RNG_Destroy(rng_t *rng)
+{
+	if (!rng)
+		return;
+	RNG_StopPrefetch(rng);
+	RNG_ReleaseID(rng->id_record);
+	if (!(rng->flags & RNG_FLAG_EXTERNAL))
+		RNG_StateRelease(rng->state);
+	Mem_AlignedFree(rng->checkpoints);
+	FREE_FUNC(rng->tree);
+	FREE_FUNC(rng->stats);
+	FREE_FUNC(rng->mode_data);
+	FREE_FUNC(rng->digests);
+	memset(rng, 0, sizeof(rng_t));
+}
+
+int RNG_IsValid(rng_t *rng)
+{
+	return (rng->state_size >= sizeof(uint64_t)*4) ? 1 : 0;
+}
+
+int RNG_SetTotalMaxStackSize(rng_t *rng, uint32_t size)
+{
+	size = Math_CeilPow2u32(size);
+
+	if (size == 0)
+		return -1;
+	if (size < rng->state_size)
+		return -1;
+	if (rng->state && !(rng->flags & RNG_FLAG_EXTERNAL) && (size < rng->state_size_allocated_bytes))
+		return -1;
+
+	rng->max_state_size = size;
+
+	return 0;
+}
+int RNG_SetUserMaxStackSize(rng_t *rng, uint32_t size)
+{
+	uint32_t current_offset = rng->state_size - rng->id_length - sizeof(uint64_t) * 4;
+	
+	size = Math_CeilPow2u32(size);
+
+	if (size == 0)
+		return -1;
+	if (size < current_offset)
+		return -1;
+
+	rng->user_state_required_size = size;
+
+	return 0;
+}
+// Allocates room for "size" bytes of user stack now, so that pushes up to that depth never allocate.
+// The reservation lasts until replaced, and ShrinkStack and copy-on-write copies keep it allocated.
+int RNG_ReserveUserStack(rng_t *rng, uint32_t size)
+{
+	uint32_t user_size = rng->state_size - rng->id_length - (uint32_t)sizeof(uint64_t) * 4;
+	uint32_t old_reserved = rng->user_reserved_size;
+
+	if (size > rng->user_state_required_size)
+		return -1;
+	if ((uint64_t)size + rng->id_length + sizeof(uint64_t) * 4 > rng->max_state_size)
+		return -1;
+
+	rng->user_reserved_size = size;
+	if (RNG_UnshareState(rng) || ((size > user_size) && RNG_ExpandStateBuffer(rng, size - user_size, RNG_EXPAND_USER)))
+	{
+		rng->user_reserved_size = old_reserved;
+		return -1;
+	}
+
+	return 0;
+}
+int RNG_ShrinkStack(rng_t *rng)
+{
+	uint32_t old_size = rng->state_size_allocated_bytes;
+	uint32_t required = RNG_RequiredStateSize(rng);
+	uint32_t target_size = Math_CeilPow2u32(required);
+	void *ptr;
+
+	RNG_STAT_ADD(rng, shrink_calls, 1);
+
+	// checkpoints and the tree are caches and are rebuilt on demand
+	Mem_AlignedFree(rng->checkpoints);
+	rng->checkpoints = 0;
+	rng->checkpoint_count = 0;
+	rng->checkpoint_capacity = 0;
+	FREE_FUNC(rng->tree);
+	rng->tree = 0;
+
+	if (!rng->state || (rng->flags & RNG_FLAG_EXTERNAL))
+		return 0;
+
+	// small enough to move back into the inline buffer
+	if (required <= RNG_INLINE_STATE_SIZE)
+	{
+		memcpy(rng->inline_state, rng->state, rng->state_size);
+		RNG_StateRelease(rng->state);
+		rng->state = 0;
+		rng->state_size_allocated_bytes = RNG_INLINE_STATE_SIZE;
+		return 0;
+	}
+
+	// a shared buffer is left alone; the first write gives this RNG a tight copy anyway
+	if (target_size == rng->state_size_allocated_bytes || RNG_StateIsShared(rng))
+		return 0;
+
+	while ((old_size >> 1) >= target_size)
+		old_size >>= 1;
+
+	if (old_size == rng->state_size_allocated_bytes)
+		return 0;
+
+	ptr = RNG_StateRealloc(rng->state, old_size, rng->state_size, rng->flags);
+
+	if (!ptr)
+		return -1;
+
+	rng->state = ptr;
+	rng->state_size_allocated_bytes = old_size;
+
+	return 0;
+}
+// A private heap state is moved at once, a shared or inline one when it is next copied to the heap.
+int RNG_SetCacheAligned(rng_t *rng, int enable)
+{
+	uint32_t old_flags = rng->flags;
+	uint8_t *ptr;
+
+	if (enable)
+		rng->flags |= RNG_FLAG_ALIGNED;
+	else
+		rng->flags &= ~RNG_FLAG_ALIGNED;
+
+	if (rng->flags == old_flags || !rng->state || (rng->flags & RNG_FLAG_EXTERNAL) || RNG_StateIsShared(rng))
+		return 0;
+
+	ptr = RNG_StateRealloc(rng->state, rng->state_size_allocated_bytes, rng->state_size, rng->flags);
+	if (!ptr)
+	{
+		rng->flags = old_flags;
+		return -1;
+	}
+	rng->state = ptr;
+
+	return 0;
+}
+int RNG_GetCacheAligned(rng_t *rng)
+{
+	return (rng->flags & RNG_FLAG_ALIGNED) ? 1 : 0;
+}
+uint32_t RNG_GetTotalMaxStackSize(rng_t *rng)
+{
+	return rng->max_state_size;
+}
+uint32_t RNG_GetUserMaxStackSize(rng_t *rng)
+{
+	uint32_t overhead = rng->id_length + sizeof(uint64_t) * 4;
+
+	if (rng->max_state_size - overhead < rng->user_state_required_size)
+		return rng->max_state_size - overhead;
+	else
+		return rng->user_state_required_size;
+}
+int RNG_SetMode(rng_t *rng, int mode)
+{
+	if (mode != RNG_MODE_STATELESS && mode != RNG_MODE_RESERVOIR && mode != RNG_MODE_STREAM)
+		return -1;
+
+	if ((mode != RNG_MODE_STATELESS) && !rng->mode_data)
+	{
+		rng->mode_data = RNG_ModeDataNew(0);
+		if (!rng->mode_data)
+			return -1;
+	}
+
+	rng->mode = (uint32_t)mode;
+	if (rng->mode_data)
+	{
+		rng->mode_data->reservoir_bits = 0;
+		rng->mode_data->reservoir_seed = 0;
+		rng->mode_data->stream_position = 0;
+	}
+
+	return 0;
+}
+int RNG_GetMode(rng_t *rng)
+{
+	return (int)rng->mode;
+}
+int RNG_SetStreamPosition(rng_t *rng, uint64_t position)
+{
+	if (rng->mode != RNG_MODE_STREAM)
+		return -1;
+
+	rng->mode_data->stream_position = position;
+
+	return 0;
+}
+uint64_t RNG_GetStreamPosition(rng_t *rng)
+{
+	return rng->mode_data ? rng->mode_data->stream_position : 0;
+}
+uint64_t RNG_GetGeneration(rng_t *rng)
+{
+	return rng->generation;
+}
+int RNG_SetLayout(rng_t *rng, int layout)
+{
+	if (layout != RNG_LAYOUT_FLAT && layout != RNG_LAYOUT_TREE)
+		return -1;
+	if ((uint32_t)layout == rng->layout)
+		return 0;
+
+	FREE_FUNC(rng->tree);
+	rng->tree = 0;
+	rng->layout = (uint32_t)layout;
+
+	// every output changes, as if the whole state had
+	RNG_InvalidateState(rng, rng->state_size);
+
+	return 0;
+}
+int RNG_GetLayout(rng_t *rng)
+{
+	return (int)rng->layout;
+}
+const rng_backend_t *RNG_GetBackend(rng_t *rng)
+{
+	return rng->backend;
+}
+
+#if defined(RNG_ENABLE_STATS)
+// metric name and help text of each rng_stats_t field, in field order
+static const char *const g_rng_stat_names[RNG_STAT_COUNT][2] =
+{
+	{"rng_hash_calls_total",			"State hashes computed, including tree nodes and ID digests."},
+	{"rng_hash_bytes_total",			"Bytes fed to state hashes."},
+	{"rng_float_retries_total",			"Extra words taken by the float functions after the first."},
+	{"rng_expand_calls_total",			"State buffer allocations and reallocations on growth."},
+	{"rng_expand_bytes_copied_total",	"Bytes moved by state buffer growth."},
+	{"rng_shrink_calls_total",			"Calls to RNG_ShrinkStack."},
+	{"rng_lock_spins_total",			"Iterations spent waiting on the global spinlocks."}
+};
+#endif
+
+// Counters of one RNG, or the totals over all threads if "rng" is NULL. Returns non-zero (and zeroes
+// *stats) if the library was built without RNG_ENABLE_STATS.
+int RNG_GetStats(rng_t *rng, rng_stats_t *stats)
+{
+#if defined(RNG_ENABLE_STATS)
+	rng_stats_block_t *block;
+	size_t i;
+
+	if (!stats)
+		return -1;
+	if (rng)
+	{
+		if (rng->stats)
+			*stats = *rng->stats;
+		else
+			memset(stats, 0, sizeof(rng_stats_t));
+		return 0;
+	}
+
+	memset(stats, 0, sizeof(rng_stats_t));
+	SpinLock_Lock(&g_rng_stats_lock);
+	for (block = g_rng_stats_blocks; block; block = block->next)
+	{
+		for (i = 0; i < RNG_STAT_COUNT; i++)
+			((uint64_t*)stats)[i] += ATOMIC_LOAD_U64(&block->counters[i]);
+	}
+	SpinLock_Unlock(&g_rng_stats_lock);
+
+	return 0;
+#else
+	(void)rng;
+	if (stats)
+		memset(stats, 0, sizeof(rng_stats_t));
+
+	return -1;
+#endif
+}
+
+// Writes the global totals to "path" in the Prometheus text exposition format. The file is written under a
+// temporary name and then renamed over "path", so a scraper never reads a partial file.
+int RNG_DumpStats(const char *path)
+{
+#if defined(RNG_ENABLE_STATS)
+	rng_stats_t stats;
+	size_t len;
+	char *tmp;
+	FILE *f;
+	size_t i;
+	int ret = 0;
+
+	if (!path || RNG_GetStats(0, &stats))
+		return -1;
+
+	len = strlen(path);
+	tmp = MALLOC_FUNC(len + sizeof(".tmp"));
+	if (!tmp)
+		return -1;
+	memcpy(tmp, path, len);
+	memcpy(&tmp[len], ".tmp", sizeof(".tmp"));
+
+	f = fopen(tmp, "w");
+	if (!f)
+	{
+		FREE_FUNC(tmp);
+		return -1;
+	}
+	for (i = 0; i < RNG_STAT_COUNT; i++)
+	{
+		if (fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", g_rng_stat_names[i][0], g_rng_stat_names[i][1],
+			g_rng_stat_names[i][0], g_rng_stat_names[i][0], (unsigned long long)((uint64_t*)&stats)[i]) < 0)
+			ret = -1;
+	}
+	if (fclose(f))
+		ret = -1;
+
+#if defined(_MSC_VER)
+	if (!ret)
+		remove(path);	// rename does not replace an existing file on Windows
+#endif
+	if (ret || rename(tmp, path))
+	{
+		remove(tmp);
+		ret = -1;
+	}
+	FREE_FUNC(tmp);
+
+	return ret;
+#else
+	(void)path;
+	return -1;
+#endif
+}
+rng_t RNG_New()
+{
+	return RNG_NewWithBackend(&RNG_BACKEND_XXH3_128);
+}
+// Sets up an RNG with an empty inline state and no counter yet. Returns non-zero if the backend is unusable.
+static int RNG_InitEmpty(rng_t *rng, const rng_backend_t *backend)
+{
+	memset(rng, 0, sizeof(rng_t));
+
+	if (!backend || !backend->hash128 || !backend->bulk_u64)
+		return -1;
+	if (backend->stream_reset && (!backend->stream_update || !backend->stream_digest || !backend->stream_state_align))
+		return -1;
+
+	rng->backend = backend;
+
+	rng->state_size = (uint32_t)sizeof(uint64_t) * 4;
+	rng->state_size_allocated_bytes = RNG_INLINE_STATE_SIZE;
+	rng->max_state_size = RNG_DEFAULT_MAX_STATE_SIZE;
+	rng->user_state_required_size = RNG_DEFAULT_MAX_STATE_SIZE;
+
+	return 0;
+}
+rng_t RNG_NewWithBackend(const rng_backend_t *backend)
+{
+	rng_t rng;
+	uint64_t counter[4];
+
+	if (RNG_InitEmpty(&rng, backend))
+	{
+		memset(&rng, 0, sizeof(rng_t));
+		return rng; // non-valid RNG
+	}
+
+	RNG_ReserveCounter256(counter, 1);
+	memcpy(rng.inline_state, counter, sizeof(counter));
+
+	return rng;
+}
+// Creates "count" RNGs in one cache-aligned allocation, seeded from one reservation of "count" consecutive
+// counter values. A NULL backend selects the default. Returns NULL on failure.
+rng_t *RNG_NewBatch(uint32_t count, const rng_backend_t *backend)
+{
+	rng_t *rngs;
+	rng_t rng;
+	uint64_t counter[4];
+	uint32_t i;
+
+	if (count == 0)
+		return 0;
+	if (RNG_InitEmpty(&rng, backend ? backend : &RNG_BACKEND_XXH3_128))
+		return 0;
+
+	rngs = Mem_AlignedMalloc((size_t)count * sizeof(rng_t), RNG_BATCH_ALIGN);
+	if (!rngs)
+		return 0;
+
+	RNG_ReserveCounter256(counter, count);
+	for (i = 0; i < count; i++)
+	{
+		memcpy(rng.inline_state, counter, sizeof(counter));
+		rngs[i] = rng;
+		RNG_IncrementCounter256(counter);
+	}
+
+	return rngs;
+}
+// Destroys every RNG of a batch, including any that have moved their state to the heap, and the batch.
+void RNG_DestroyBatch(rng_t *rngs, uint32_t count)
+{
+	uint32_t i;
+
+	if (!rngs)
+		return;
+	for (i = 0; i < count; i++)
+		RNG_Destroy(&rngs[i]);
+	Mem_AlignedFree(rngs);
+}
+// Same as RNG_New, but the state lives in "size" bytes of caller storage (at least 32) until it outgrows it.
+// The storage must outlive the RNG, and is not freed by RNG_Destroy.
+rng_t RNG_NewInPlace(void *storage, uint32_t size)
+{
+	rng_t rng = RNG_New();
+
+	if (!storage || size < (uint32_t)sizeof(uint64_t) * 4 || !RNG_IsValid(&rng))
+	{
+		memset(&rng, 0, sizeof(rng_t));
+		return rng; // non-valid RNG
+	}
+
+	memcpy(storage, rng.inline_state, rng.state_size);
+	rng.state = (uint8_t*)storage;
+	rng.state_size_allocated_bytes = size;
+	rng.flags |= RNG_FLAG_EXTERNAL;
+
+	return rng;
+}
+// Child "data" of a parent whose state hashes to "key": an empty RNG on the parent's backend and mode whose
+// 32-byte base is two 128-bit hashes (seeds 0 and 1) of (key, data, domain tag) instead of a counter value.
+// Returns non-zero, leaving a non-valid child, if the child's mode state cannot be allocated.
+static int RNG_DeriveChild(rng_t *child, const rng_t *parent, const uint64_t *key, uint64_t data)
+{
+	uint64_t input[4];
+	uint64_t base[4];
+
+	input[0] = key[0];
+	input[1] = key[1];
+	input[2] = data;
+	input[3] = RNG_DERIVE_DOMAIN;
+
+	parent->backend->hash128(input, sizeof(input), 0, &base[0]);
+	parent->backend->hash128(input, sizeof(input), 1, &base[2]);
+	RNG_STAT_ADD(0, hash_calls, 2);
+	RNG_STAT_ADD(0, hash_bytes, 2 * sizeof(input));
+
+	RNG_InitEmpty(child, parent->backend);
+	if (parent->mode != RNG_MODE_STATELESS)
+	{
+		child->mode_data = RNG_ModeDataNew(0);
+		if (!child->mode_data)
+		{
+			memset(child, 0, sizeof(rng_t));
+			return -1;
+		}
+	}
+	child->mode = parent->mode;
+	memcpy(child->inline_state, base, sizeof(base));
+
+	return 0;
+}
+rng_t RNG_FoldIn(rng_t *parent, uint64_t data)
+{
+	rng_t rng;
+	XXH128_hash_t h;
+	uint64_t key[2];
+
+	if (!RNG_IsValid(parent))
+	{
+		memset(&rng, 0, sizeof(rng_t));
+		return rng; // non-valid RNG
+	}
+
+	h = RNG_StateDigest128(parent, 0);
+	key[0] = h.low64;
+	key[1] = h.high64;
+	RNG_DeriveChild(&rng, parent, key, data);
+
+	return rng;
+}
+// children[i] = RNG_FoldIn(parent, i), hashing the parent state once
+int RNG_Split(rng_t *parent, uint32_t n, rng_t *children)
+{
+	XXH128_hash_t h;
+	uint64_t key[2];
+	uint32_t i;
+
+	if (!RNG_IsValid(parent) || (n && !children))
+		return -1;
+
+	h = RNG_StateDigest128(parent, 0);
+	key[0] = h.low64;
+	key[1] = h.high64;
+	for (i = 0; i < n; i++)
+	{
+		if (RNG_DeriveChild(&children[i], parent, key, i))
+		{
+			while (i--)
+				RNG_Destroy(&children[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+rng_t RNG_Clone(rng_t *old_rng)
+{
+	rng_t rng = *old_rng;
+
+	if (rng.id_record)
+		ATOMIC_FETCH_ADD_U32(&rng.id_record->refs, 1);
+
+	rng.stats = 0;
+	rng.digests = 0;
+	if (old_rng->mode_data)
+	{
+		rng.mode_data = RNG_ModeDataNew(old_rng->mode_data);
+		if (!rng.mode_data)
+		{
+			RNG_ReleaseID(rng.id_record);
+			memset(&rng, 0, sizeof(rng_t));
+			return rng; // non-valid RNG
+		}
+	}
+
+	rng.state = 0;
+	rng.state_size_allocated_bytes = RNG_INLINE_STATE_SIZE;
+	rng.flags &= ~RNG_FLAG_EXTERNAL;
+	rng.checkpoints = 0;
+	rng.checkpoint_count = 0;
+	rng.checkpoint_capacity = 0;
+	rng.tree = 0;
+
+	// heap states are shared until either side writes
+	if (old_rng->state && !(old_rng->flags & RNG_FLAG_EXTERNAL))
+	{
+		ATOMIC_FETCH_ADD_U32(RNG_StateRefs(old_rng->state), 1);
+		rng.state = old_rng->state;
+		rng.state_size_allocated_bytes = old_rng->state_size_allocated_bytes;
+		return rng;
+	}
+
+	if (old_rng->state_size > RNG_INLINE_STATE_SIZE)
+	{
+		rng.state_size = 0; // nothing to carry over from the inline buffer
+		if (RNG_ExpandStateBuffer(&rng, old_rng->state_size, RNG_EXPAND_BASE))
+		{
+			RNG_ReleaseID(rng.id_record);
+			FREE_FUNC(rng.mode_data);
+			memset(&rng, 0, (uint32_t)sizeof(rng_t));
+			return rng; // non-valid RNG
+		}
+		rng.state_size = old_rng->state_size;
+	}
+
+	memcpy(RNG_StateData(&rng), RNG_StateData(old_rng), old_rng->state_size);
+
+	return rng;
+}
+
+int RNG_SetID(rng_t *rng, void *data, uint32_t data_len)
+{
+	uint32_t new_id_length = data_len;
+	uint32_t old_userdata_size = rng->state_size - rng->id_length - (uint32_t)sizeof(uint64_t) * 4;
+	uint32_t req_size = old_userdata_size + new_id_length + (uint32_t)sizeof(uint64_t) * 4;
+	uint64_t reserved_size = (uint64_t)rng->user_reserved_size + new_id_length + sizeof(uint64_t) * 4;
+	uint8_t *old_userdata_p;
+	uint8_t *new_userdata_p;
+
+	// a longer ID keeps the reserved user stack allocated behind it, as far as the maximum size allows
+	if ((reserved_size > req_size) && (reserved_size <= rng->max_state_size))
+		req_size = (uint32_t)reserved_size;
+	if (RNG_ExpandStateBuffer(rng, req_size, RNG_EXPAND_ID))
+		return -1; // valid RNG but without ID updated
+
+	old_userdata_p = &RNG_StateData(rng)[(uint32_t)sizeof(uint64_t) * 4 + rng->id_length];
+	new_userdata_p = &RNG_StateData(rng)[(uint32_t)sizeof(uint64_t) * 4 + new_id_length];
+
+	RNG_InvalidateState(rng, (uint32_t)sizeof(uint64_t) * 4);
+
+	memmove(new_userdata_p, old_userdata_p, old_userdata_size);
+	memcpy(&RNG_StateData(rng)[(uint32_t)sizeof(uint64_t) * 4], data, new_id_length);
+
+	rng->state_size = rng->state_size + new_id_length - rng->id_length;
+	rng->id_length = new_id_length;
+	rng->id_type = RNG_ID_TYPE_GENERIC;
+
+	RNG_ReleaseID(rng->id_record);
+	rng->id_record = 0;
+
+	return 0;
+}
+int RNG_SetIDString(rng_t *rng, char *string)
+{
+	int ret = RNG_SetID(rng, string, (uint32_t)strlen(string));
 	if (!ret)
 		rng->id_type = RNG_ID_TYPE_STRING;
 	return ret;
 }
-int RNG_SetIDu64(rng_t *rng, uint64_t id)
+int RNG_SetIDu64(rng_t *rng, uint64_t id)
+{
+	int ret = RNG_SetID(rng, &id, (uint32_t)sizeof(uint64_t));
+	if (!ret)
+		rng->id_type = RNG_ID_TYPE_U64;
+	return ret;
+}
+int RNG_SetIDStringHash(rng_t *rng, char *string)
+{
+	uint64_t val = HASH_FUNCTION64(string, strlen(string), 0);
+	int ret = RNG_SetID(rng, &val, (uint32_t)sizeof(uint64_t));
+	RNG_STAT_HASH(rng, strlen(string));
+	if (!ret)
+		rng->id_type = RNG_ID_TYPE_HASH;
+	return ret;
+}
+
+// The state holds the digest of the record, and the RNG one reference to it.
+int RNG_SetIDInterned(rng_t *rng, rng_id_t *id)
+{
+	if (!id)
+		return -1;
+	// referenced first: RNG_SetID releases the old record, which may be "id" itself
+	ATOMIC_FETCH_ADD_U32(&id->refs, 1);
+	if (RNG_SetID(rng, id->digest, (uint32_t)sizeof(id->digest)))
+	{
+		RNG_ReleaseID(id);
+		return -1;
+	}
+
+	rng->id_record = id;
+	rng->id_type = RNG_ID_TYPE_INTERNED;
+
+	return 0;
+}
+
+uint32_t RNG_GetIDLength(rng_t *rng)
+{
+	if (rng->id_type == RNG_ID_TYPE_INTERNED)
+		return rng->id_record->length + (rng->id_record->type == RNG_ID_TYPE_STRING ? 1 : 0);
+
+	return rng->id_length + (rng->id_type == RNG_ID_TYPE_STRING ? 1 : 0);
+}
+int RNG_GetIDType(rng_t *rng)
+{
+	return rng->id_type;
+}
+int RNG_CopyID(rng_t *rng, void *buffer)
+{
+	if (rng->id_type == RNG_ID_TYPE_INTERNED)
+	{
+		memcpy(buffer, rng->id_record->data, rng->id_record->length);
+		if (rng->id_record->type == RNG_ID_TYPE_STRING)
+			((uint8_t*)buffer)[rng->id_record->length] = '\0';
+		return 0;
+	}
+	if (rng->id_length)
+	{
+		memcpy(buffer, &RNG_StateData(rng)[(uint32_t)sizeof(uint64_t) * 4], rng->id_length);
+		if (rng->id_type == RNG_ID_TYPE_STRING)
+			((uint8_t*)buffer)[rng->id_length] = '\0';
+		return 0;
+	}
+	else
+		return -1;
+}
+
+int RNG_SetRelative(rng_t *rng, uint32_t offset, void *data, uint32_t size)
+{
+	uint32_t user_size = rng->state_size - rng->id_length - sizeof(uint64_t) * 4;
+
+	if (offset > user_size)
+		return -1;
+	if (offset < size)
+		return -1;
+	if (RNG_UnshareState(rng))
+		return -1;
+
+	RNG_InvalidateRange(rng, (uint32_t)sizeof(uint64_t) * 4 + rng->id_length + (user_size - offset), (uint32_t)sizeof(uint64_t) * 4 + rng->id_length + (user_size - offset) + size);
+
+	memcpy(&RNG_StateData(rng)[(uint32_t)sizeof(uint64_t) * 4 + rng->id_length + (user_size - offset)], data, size);
+
+	return 0;
+}
+
+uint32_t RNG_GetTotalStackDepth(rng_t *rng)
+{
+	return rng->state_size;
+}
+uint32_t RNG_GetUserStackDepth(rng_t *rng)
+{
+	return rng->state_size - rng->id_length - sizeof(uint64_t) * 4;
+}
+
+int RNG_SetRelativeu64(rng_t *rng, uint32_t offset, uint64_t x)
+{
+	return RNG_SetRelative(rng, offset * sizeof(uint64_t), &x, sizeof(uint64_t));
+}
+int RNG_SetRelativeu32(rng_t *rng, uint32_t offset, uint32_t x)
+{
+	return RNG_SetRelative(rng, offset * sizeof(uint32_t), &x, sizeof(uint32_t));
+}
+int RNG_SetRelativeu16(rng_t *rng, uint32_t offset, uint16_t x)
+{
+	return RNG_SetRelative(rng, offset * sizeof(uint16_t), &x, sizeof(uint16_t));
+}
+int RNG_SetRelativeu8(rng_t *rng, uint32_t offset, uint8_t x)
+{
+	return RNG_SetRelative(rng, offset * sizeof(uint8_t), &x, sizeof(uint8_t));
+}
+int RNG_SetRelativei64(rng_t *rng, int32_t offset, int64_t x)
+{
+	return RNG_SetRelative(rng, offset * sizeof(int64_t), &x, sizeof(int64_t));
+}
+int RNG_SetRelativei32(rng_t *rng, int32_t offset, int32_t x)
+{
+	return RNG_SetRelative(rng, offset * sizeof(int32_t), &x, sizeof(int32_t));
+}
+int RNG_SetRelativei16(rng_t *rng, int32_t offset, int16_t x)
+{
+	return RNG_SetRelative(rng, offset * sizeof(int16_t), &x, sizeof(int16_t));
+}
+int RNG_SetRelativei8(rng_t *rng, int32_t offset, int8_t x)
+{
+	return RNG_SetRelative(rng, offset * sizeof(int8_t), &x, sizeof(int8_t));
+}
+int RNG_GetRelative(rng_t *rng, uint32_t offset, void *data, uint32_t size)
+{
+	uint32_t user_size = rng->state_size - rng->id_length - sizeof(uint64_t) * 4;
+
+	if (offset > user_size)
+		return -1;
+	if (offset < size)
+		return -1;
+
+	memcpy(data, &RNG_StateData(rng)[(uint32_t)sizeof(uint64_t) * 4 + rng->id_length + (user_size - offset)], size);
+
+	return 0;
+}
+
+int RNG_GetRelativeu64(rng_t *rng, uint32_t offset, uint64_t *x)
+{
+	return RNG_GetRelative(rng, offset * sizeof(uint64_t), x, sizeof(uint64_t));
+}
+int RNG_GetRelativeu32(rng_t *rng, uint32_t offset, uint32_t *x)
+{
+	return RNG_GetRelative(rng, offset * sizeof(uint32_t), x, sizeof(uint32_t));
+}
+int RNG_GetRelativeu16(rng_t *rng, uint32_t offset, uint16_t *x)
+{
+	return RNG_GetRelative(rng, offset * sizeof(uint16_t), x, sizeof(uint16_t));
+}
+int RNG_GetRelativeu8(rng_t *rng, uint32_t offset, uint8_t *x)
+{
+	return RNG_GetRelative(rng, offset * sizeof(uint8_t), x, sizeof(uint8_t));
+}
+int RNG_GetRelativei64(rng_t *rng, int32_t offset, int64_t *x)
+{
+	return RNG_GetRelative(rng, offset * sizeof(int64_t), x, sizeof(int64_t));
+}
+int RNG_GetRelativei32(rng_t *rng, int32_t offset, int32_t *x)
+{
+	return RNG_GetRelative(rng, offset * sizeof(int32_t), x, sizeof(int32_t));
+}
+int RNG_GetRelativei16(rng_t *rng, int32_t offset, int16_t *x)
+{
+	return RNG_GetRelative(rng, offset * sizeof(int16_t), x, sizeof(int16_t));
+}
+int RNG_GetRelativei8(rng_t *rng, int32_t offset, int8_t *x)
+{
+	return RNG_GetRelative(rng, offset * sizeof(int8_t), x, sizeof(int8_t));
+}
+int RNG_Push(rng_t *rng, void *data, uint32_t size)
+{
+	if (RNG_ExpandStateBuffer(rng, size, RNG_EXPAND_USER))
+		return -1; // valid RNG but without value pushed
+
+	RNG_InvalidateState(rng, rng->state_size);
+
+	if (data)
+		memcpy(&RNG_StateData(rng)[rng->state_size], data, size);
+
+	rng->state_size += size;
+
+	return 0;
+}
+
+int RNG_Pushu64(rng_t *rng, uint64_t x)
+{
+	return RNG_Push(rng, &x, (uint32_t)sizeof(uint64_t));
+}
+int RNG_Pushu32(rng_t *rng, uint32_t x)
+{
+	return RNG_Push(rng, &x, (uint32_t)sizeof(uint32_t));
+}
+int RNG_Pushu16(rng_t *rng, uint16_t x)
+{
+	return RNG_Push(rng, &x, (uint32_t)sizeof(uint16_t));
+}
+int RNG_Pushu8(rng_t *rng, uint8_t x)
+{
+	return RNG_Push(rng, &x, (uint32_t)sizeof(uint8_t));
+}
+int RNG_Pushi64(rng_t *rng, int64_t x)
+{
+	return RNG_Push(rng, &x, (uint32_t)sizeof(int64_t));
+}
+int RNG_Pushi32(rng_t *rng, int32_t x)
+{
+	return RNG_Push(rng, &x, (uint32_t)sizeof(int32_t));
+}
+int RNG_Pushi16(rng_t *rng, int16_t x)
+{
+	return RNG_Push(rng, &x, (uint32_t)sizeof(int16_t));
+}
+int RNG_Pushi8(rng_t *rng, int8_t x)
+{
+	return RNG_Push(rng, &x, (uint32_t)sizeof(int8_t));
+}
+
+int RNG_Pop(rng_t *rng, void *data, uint32_t size)
+{
+	if (rng->state_size < size + (uint32_t)sizeof(uint64_t)*4 + rng->id_length)
+		return -1;
+	
+	if (data)
+		memcpy(data, &RNG_StateData(rng)[rng->state_size - size], size);
+	
+	rng->state_size -= size;
+
+	RNG_InvalidateState(rng, rng->state_size);
+
+	return 0;
+}
+int RNG_Popu64(rng_t *rng, uint64_t *x)
+{
+	return RNG_Pop(rng, x, (uint32_t)sizeof(uint64_t));
+}
+int RNG_Popu32(rng_t *rng, uint32_t *x)
+{
+	return RNG_Pop(rng, x, (uint32_t)sizeof(uint32_t));
+}
+int RNG_Popu16(rng_t *rng, uint16_t *x)
+{
+	return RNG_Pop(rng, x, (uint32_t)sizeof(uint16_t));
+}
+int RNG_Popu8(rng_t *rng, uint8_t *x)
+{
+	return RNG_Pop(rng, x, (uint32_t)sizeof(uint8_t));
+}
+int RNG_Popi64(rng_t *rng, int64_t *x)
+{
+	return RNG_Pop(rng, x, (uint32_t)sizeof(int64_t));
+}
+int RNG_Popi32(rng_t *rng, int32_t *x)
+{
+	return RNG_Pop(rng, x, (uint32_t)sizeof(int32_t));
+}
+int RNG_Popi16(rng_t *rng, int16_t *x)
+{
+	return RNG_Pop(rng, x, (uint32_t)sizeof(int16_t));
+}
+int RNG_Popi8(rng_t *rng, int8_t *x)
+{
+	return RNG_Pop(rng, x, (uint32_t)sizeof(int8_t));
+}
+void RNG_ResetStack(rng_t *rng)
+{
+	rng->state_size = (uint32_t)sizeof(uint64_t)*4 + rng->id_length;
+
+	RNG_InvalidateState(rng, rng->state_size);
+}
+
+uint64_t RNG_Randomu64(rng_t *rng)
+{
+	return (uint64_t)RNG_NextBits(rng, 64);
+}
+uint32_t RNG_Randomu32(rng_t *rng)
+{
+	return (uint32_t)RNG_NextBits(rng, 32);
+}
+uint16_t RNG_Randomu16(rng_t *rng)
+{
+	return (uint16_t)RNG_NextBits(rng, 16);
+}
+uint8_t RNG_Randomu8(rng_t *rng)
+{
+	return (uint8_t)RNG_NextBits(rng, 8);
+}
+
+int64_t RNG_Randomi64(rng_t *rng)
+{
+	return (int64_t)RNG_NextBits(rng, 64);
+}
+int32_t RNG_Randomi32(rng_t *rng)
+{
+	return (int32_t)RNG_NextBits(rng, 32);
+}
+int16_t RNG_Randomi16(rng_t *rng)
+{
+	return (int16_t)RNG_NextBits(rng, 16);
+}
+int8_t RNG_Randomi8(rng_t *rng)
+{
+	return (int8_t)RNG_NextBits(rng, 8);
+}
+
+// Word generators feed the float constructors below. "index" is the position of the word in the sequence
+// consumed by one float, which for the stack hash is the seed passed to the hash function.
+typedef uint64_t (*rng_word_fn_t)(void *ctx, uint32_t index);
+
+typedef struct rng_flat_ctx_s
+{
+	const rng_backend_t	*backend;
+	const uint8_t		*state;
+	uint32_t			size;
+}rng_flat_ctx_t;
+
+typedef struct rng_root_ctx_s
+{
+	const rng_backend_t	*backend;
+	uint64_t			root[2];
+	uint32_t			size;
+}rng_root_ctx_t;
+
+typedef struct rng_at_ctx_s
+{
+	rng_t				*rng;
+	const uint64_t		*coords;
+	uint32_t			ncoords;
+}rng_at_ctx_t;
+
+typedef struct rng_bulk_ctx_s
+{
+	const rng_backend_t	*backend;
+	uint64_t			key[2];
+	uint64_t			index;
+}rng_bulk_ctx_t;
+
+static INLINE_DEF float RNG_MakeFloat32(rng_word_fn_t word, void *ctx)
+{
+	uint64_t current;
+	uint32_t cnt;
+	uint32_t pw2;    
+	uint32_t m;
+	float f;
+
+	current = word(ctx, 0);
+	cnt = (uint32_t)Math_LZCnt64(current);
+	pw2 = cnt;
+
+	/*
+	// testing purposes
+	current = (current >> 41) | 0x3f800000;
+	return *(float*)&current - 1.0f;
+	*/
+
+	if (cnt == RNG_HASH_BITS)
+	{
+		current = word(ctx, 1);
+		cnt = (uint32_t)Math_LZCnt64(current);
+		pw2 += cnt;
+	}
+
+	// if less than "FP32_MANTISSA_BITS" bits left, we need to generate a new hash to fill the mantissa
+	if (RNG_HASH_BITS - cnt - 1 < FP32_MANTISSA_BITS)
+	{
+		current = word(ctx, 2);
+	}
+
+	if (pw2 < (uint32_t)((1 << (FP32_EXPONENT_BITS - 1)) - 2))
+		m = ((1 << (FP32_EXPONENT_BITS - 1)) - 2 - pw2) << FP32_MANTISSA_BITS;
+	else // subnormal
+		m = 0;
+
+	m |= FP32_MANTISSA_MASK & current;
+
+	memcpy(&f, &m, sizeof(float));
+
+	return f;
+}
+
+static INLINE_DEF double RNG_MakeFloat64(rng_word_fn_t word, void *ctx)
+{
+	uint64_t current;
+	int32_t cnt;
+	uint32_t pw2;    
+	// ceil((2^(ebits - 1) - 2) / 2^hashbits)
+	const uint32_t maxrec = ((uint32_t)(1 << (FP64_EXPONENT_BITS - 1)) - 2 + RNG_HASH_BITS - 1) >> RNG_HASH_BITS_LOG2;
+	uint64_t m;
+	uint32_t i;
+	double d;
+
+	current = word(ctx, 0);
+	cnt = (uint32_t)Math_LZCnt64(current);
+	pw2 = cnt;
+
+	for (i = 1; (i < maxrec) && (cnt == RNG_HASH_BITS); i++)
+	{
+		current = word(ctx, i);
+		cnt = (uint32_t)Math_LZCnt64(current);
+		pw2 += cnt;
+	}
+
+	// if less than "FP64_MANTISSA_BITS" bits left, we need to generate a new hash to fill the mantissa
+	if (RNG_HASH_BITS - cnt - 1 < FP64_MANTISSA_BITS)
+	{
+		current = word(ctx, i);
+	}
+
+	if (pw2 < (uint32_t)((1 << (FP64_EXPONENT_BITS - 1)) - 2))
+		m = ((((uint64_t)1) << (FP64_EXPONENT_BITS - 1)) - 2 - pw2) << FP64_MANTISSA_BITS;
+	else // subnormal
+		m = 0;
+
+	m |= FP64_MANTISSA_MASK & current;
+
+	memcpy(&d, &m, sizeof(double));
+
+	return d;
+}
+
+static uint64_t RNG_StateWord(void *ctx, uint32_t index)
 {
-	int ret = RNG_SetID(rng, &id, (uint32_t)sizeof(uint64_t));
-	if (!ret)
-		rng->id_type = RNG_ID_TYPE_U64;
-	return ret;
+	if (index)
+		RNG_STAT_ADD((rng_t*)ctx, float_retries, 1);
+
+	return RNG_StateHash64((rng_t*)ctx, index);
 }
-int RNG_SetIDStringHash(rng_t *rng, char *string)
+// Stream floats take each word, retries included, from the next stream position.
+static uint64_t RNG_StreamWord(void *ctx, uint32_t index)
 {
-	uint64_t val = HASH_FUNCTION64(string, strlen(string), 0);
-	int ret = RNG_SetID(rng, &val, (uint32_t)sizeof(uint64_t));
-	if (!ret)
-		rng->id_type = RNG_ID_TYPE_HASH;
-	return ret;
+	if (index)
+		RNG_STAT_ADD((rng_t*)ctx, float_retries, 1);
+
+	return RNG_StreamNext((rng_t*)ctx);
 }
 
-uint32_t RNG_GetIDLength(rng_t *rng)
+// flat hash of a state that is not (or not exactly) the state of an rng_t, without checkpoints
+static uint64_t RNG_FlatWord(void *ctx, uint32_t index)
 {
-	return rng->id_length + (rng->id_type == RNG_ID_TYPE_STRING ? 1 : 0);
+	const rng_flat_ctx_t *flat = (const rng_flat_ctx_t*)ctx;
+
+	RNG_STAT_HASH(0, flat->size);
+	if (index)
+		RNG_STAT_ADD(0, float_retries, 1);
+
+	return RNG_BackendHash128(flat->backend, flat->state, flat->size, index).low64;
 }
-int RNG_GetIDType(rng_t *rng)
+
+// tree-layout hash of a state with the given root that is not (or not exactly) the state of an rng_t
+static uint64_t RNG_RootWord(void *ctx, uint32_t index)
 {
-	return rng->id_type;
+	const rng_root_ctx_t *root = (const rng_root_ctx_t*)ctx;
+
+	if (index)
+		RNG_STAT_ADD(0, float_retries, 1);
+
+	return RNG_TreeFinal(0, root->backend, root->root, root->size, index).low64;
 }
-int RNG_CopyID(rng_t *rng, void *buffer)
+
+// Hash of the state with "coords" pushed on top, without writing to the RNG. Small inputs are assembled on
+// the stack. Larger ones are streamed: state, then coords, resuming from the deepest valid checkpoint for
+// seed 0. Checkpoints are only read, so this is safe to call from several threads on one unchanging rng_t.
+static uint64_t RNG_AtHash64(rng_t *rng, const uint64_t *coords, uint32_t ncoords, uint64_t seed)
 {
-	if (rng->id_length)
+	const rng_backend_t *backend = rng->backend;
+	size_t coords_size = (size_t)ncoords * sizeof(uint64_t);
+	size_t size = rng->state_size + coords_size;
+	XXH_ALIGN(64) uint8_t local[RNG_AT_LOCAL_SIZE];
+	uint8_t *buffer = NULL;
+	uint64_t h[2];
+	uint32_t offset = 0;
+
+	if (rng->layout == RNG_LAYOUT_TREE)
 	{
-		memcpy(buffer, &rng->state[(uint32_t)sizeof(uint64_t) * 4], rng->id_length);
-		if (rng->id_type == RNG_ID_TYPE_STRING)
-			((uint8_t*)buffer)[rng->id_length] = '\0';
+		RNG_TreeRootSegments(0, backend, RNG_StateData(rng), rng->state_size, (const uint8_t*)coords, coords_size, h);
+		return RNG_TreeFinal(0, backend, h, size, seed).low64;
+	}
+
+	if (size <= RNG_AT_LOCAL_SIZE)
+	{
+		memcpy(local, RNG_StateData(rng), rng->state_size);
+		memcpy(&local[rng->state_size], coords, coords_size);
+		RNG_STAT_HASH(0, size);
+		return RNG_BackendHash128(backend, local, size, seed).low64;
+	}
+
+	if (backend->stream_reset)
+	{
+		if ((backend->stream_state_size <= RNG_AT_LOCAL_SIZE) && (backend->stream_state_align <= 64))
+			buffer = local;
+		else
+			buffer = Mem_AlignedMalloc(backend->stream_state_size, backend->stream_state_align);
+	}
+	if (buffer)
+	{
+		if ((seed == 0) && rng->checkpoint_count)
+		{
+			memcpy(buffer, &((uint8_t*)rng->checkpoints)[(rng->checkpoint_count - 1) * RNG_CheckpointStride(backend)], backend->stream_state_size);
+			offset = rng->checkpoint_count * RNG_CHECKPOINT_INTERVAL;
+		}
+		else
+			backend->stream_reset(buffer, seed);
+
+		backend->stream_update(buffer, &RNG_StateData(rng)[offset], rng->state_size - offset);
+		backend->stream_update(buffer, coords, coords_size);
+		backend->stream_digest(buffer, h);
+		RNG_STAT_HASH(0, size - offset);
+
+		if (buffer != local)
+			Mem_AlignedFree(buffer);
+
+		return h[0];
+	}
+
+	// no usable stream interface: hash a flat heap copy
+	buffer = MALLOC_FUNC(size);
+	if (!buffer)
 		return 0;
+	memcpy(buffer, RNG_StateData(rng), rng->state_size);
+	memcpy(&buffer[rng->state_size], coords, coords_size);
+	backend->hash128(buffer, size, seed, h);
+	RNG_STAT_HASH(0, size);
+	FREE_FUNC(buffer);
+
+	return h[0];
+}
+static uint64_t RNG_AtWord(void *ctx, uint32_t index)
+{
+	const rng_at_ctx_t *at = (const rng_at_ctx_t*)ctx;
+
+	if (index)
+		RNG_STAT_ADD(0, float_retries, 1);
+
+	return RNG_AtHash64(at->rng, at->coords, at->ncoords, index);
+}
+
+// Word 0 of a bulk float is the primary stream; the rare retry words come from a second stream keyed with
+// the key halves swapped, indexed so that every (element, word) pair is distinct.
+static uint64_t RNG_BulkWord(void *ctx, uint32_t index)
+{
+	const rng_bulk_ctx_t *bulk = (const rng_bulk_ctx_t*)ctx;
+	uint64_t swapped[2];
+	uint64_t word;
+
+	if (index == 0)
+	{
+		bulk->backend->bulk_u64(bulk->key, bulk->index, &word, 1);
 	}
 	else
-		return -1;
+	{
+		RNG_STAT_ADD(0, float_retries, 1);
+		swapped[0] = bulk->key[1];
+		swapped[1] = bulk->key[0];
+		bulk->backend->bulk_u64(swapped, (bulk->index << RNG_BULK_RETRY_BITS) | index, &word, 1);
+	}
+
+	return word;
 }
 
-int RNG_SetRelative(rng_t *rng, uint32_t offset, void *data, uint32_t size)
+static INLINE_DEF void RNG_BulkKey(rng_t *rng, uint64_t *key)
 {
-	uint32_t user_size = rng->state_size - rng->id_length - sizeof(uint64_t) * 4;
+	XXH128_hash_t h = RNG_StateDigest128(rng, 0);
 
-	if (offset > user_size)
-		return -1;
-	if (offset < size)
-		return -1;
+	key[0] = h.low64;
+	key[1] = h.high64;
+}
+
+// Converts one block of bulk words to floats in place of the bulk index range [first, first + count).
+static INLINE_DEF void RNG_BulkToFloat32(rng_bulk_ctx_t *bulk, const uint64_t *words, uint64_t first, float *out, size_t count)
+{
+	uint64_t current;
+	uint32_t cnt;
+	uint32_t m;
+	size_t i;
 
-	memcpy(&rng->state[(uint32_t)sizeof(uint64_t) * 4 + rng->id_length + (user_size - offset)], data, size);
+	for (i = 0; i < count; i++)
+	{
+		current = words[i];
+		cnt = (uint32_t)Math_LZCnt64(current);
 
-	return 0;
+		// common case, kept branch-light so the loop vectorises: enough bits below the leading one for the mantissa
+		if (RNG_HASH_BITS - cnt - 1 >= FP32_MANTISSA_BITS)
+		{
+			m = (((1 << (FP32_EXPONENT_BITS - 1)) - 2 - cnt) << FP32_MANTISSA_BITS) | ((uint32_t)current & FP32_MANTISSA_MASK);
+			memcpy(&out[i], &m, sizeof(float));
+		}
+		else
+		{
+			bulk->index = first + i;
+			out[i] = RNG_MakeFloat32(RNG_BulkWord, bulk);
+		}
+	}
 }
-
-uint32_t RNG_GetTotalStackDepth(rng_t *rng)
+static INLINE_DEF void RNG_BulkToFloat64(rng_bulk_ctx_t *bulk, const uint64_t *words, uint64_t first, double *out, size_t count)
 {
-	return rng->state_size;
+	uint64_t current;
+	uint32_t cnt;
+	uint64_t m;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		current = words[i];
+		cnt = (uint32_t)Math_LZCnt64(current);
+
+		if (RNG_HASH_BITS - cnt - 1 >= FP64_MANTISSA_BITS)
+		{
+			m = ((((uint64_t)1 << (FP64_EXPONENT_BITS - 1)) - 2 - cnt) << FP64_MANTISSA_BITS) | (current & FP64_MANTISSA_MASK);
+			memcpy(&out[i], &m, sizeof(double));
+		}
+		else
+		{
+			bulk->index = first + i;
+			out[i] = RNG_MakeFloat64(RNG_BulkWord, bulk);
+		}
+	}
 }
-uint32_t RNG_GetUserStackDepth(rng_t *rng)
+
+uint64_t RNG_RandomBits(rng_t *rng, uint32_t nbits)
 {
-	return rng->state_size - rng->id_length - sizeof(uint64_t) * 4;
+	if (nbits == 0)
+		return 0;
+	if (nbits > RNG_HASH_BITS)
+		nbits = RNG_HASH_BITS;
+
+	if (nbits == RNG_HASH_BITS)
+		return RNG_NextBits(rng, nbits);
+	else
+		return RNG_NextBits(rng, nbits) & ((((uint64_t)1) << nbits) - 1);
 }
 
-int RNG_SetRelativeu64(rng_t *rng, uint32_t offset, uint64_t x)
+float RNG_Randomf32(rng_t *rng)
 {
-	return RNG_SetRelative(rng, offset * sizeof(uint64_t), &x, sizeof(uint64_t));
+	if (rng->mode == RNG_MODE_RESERVOIR)
+		return RNG_ReservoirFloat32(rng);
+	if (rng->mode == RNG_MODE_STREAM)
+		return RNG_MakeFloat32(RNG_StreamWord, rng);
+
+	return RNG_MakeFloat32(RNG_StateWord, rng);
 }
-int RNG_SetRelativeu32(rng_t *rng, uint32_t offset, uint32_t x)
+
+double RNG_Randomf64(rng_t *rng)
 {
-	return RNG_SetRelative(rng, offset * sizeof(uint32_t), &x, sizeof(uint32_t));
+	if (rng->mode == RNG_MODE_RESERVOIR)
+		return RNG_ReservoirFloat64(rng);
+	if (rng->mode == RNG_MODE_STREAM)
+		return RNG_MakeFloat64(RNG_StreamWord, rng);
+
+	return RNG_MakeFloat64(RNG_StateWord, rng);
 }
-int RNG_SetRelativeu16(rng_t *rng, uint32_t offset, uint16_t x)
+
+void RNG_Randomu64xN(rng_t *rng, uint32_t n, uint64_t *out)
 {
-	return RNG_SetRelative(rng, offset * sizeof(uint16_t), &x, sizeof(uint16_t));
+	RNG_StateDigestN(rng, 0, n, out);
 }
-int RNG_SetRelativeu8(rng_t *rng, uint32_t offset, uint8_t x)
+
+uint64_t RNG_RandomAtu64(rng_t *rng, const uint64_t *coords, uint32_t ncoords)
 {
-	return RNG_SetRelative(rng, offset * sizeof(uint8_t), &x, sizeof(uint8_t));
+	return RNG_AtHash64(rng, coords, ncoords, 0);
 }
-int RNG_SetRelativei64(rng_t *rng, int32_t offset, int64_t x)
+float RNG_RandomAtf32(rng_t *rng, const uint64_t *coords, uint32_t ncoords)
 {
-	return RNG_SetRelative(rng, offset * sizeof(int64_t), &x, sizeof(int64_t));
+	rng_at_ctx_t at;
+
+	at.rng = rng;
+	at.coords = coords;
+	at.ncoords = ncoords;
+
+	return RNG_MakeFloat32(RNG_AtWord, &at);
 }
-int RNG_SetRelativei32(rng_t *rng, int32_t offset, int32_t x)
+double RNG_RandomAtf64(rng_t *rng, const uint64_t *coords, uint32_t ncoords)
 {
-	return RNG_SetRelative(rng, offset * sizeof(int32_t), &x, sizeof(int32_t));
+	rng_at_ctx_t at;
+
+	at.rng = rng;
+	at.coords = coords;
+	at.ncoords = ncoords;
+
+	return RNG_MakeFloat64(RNG_AtWord, &at);
 }
-int RNG_SetRelativei16(rng_t *rng, int32_t offset, int16_t x)
+
+void RNG_Fillu64(rng_t *rng, uint64_t *out, size_t count)
 {
-	return RNG_SetRelative(rng, offset * sizeof(int16_t), &x, sizeof(int16_t));
+	uint64_t key[2];
+
+	RNG_BulkKey(rng, key);
+
+	rng->backend->bulk_u64(key, 0, out, count);
 }
-int RNG_SetRelativei8(rng_t *rng, int32_t offset, int8_t x)
+
+void RNG_Fillf32(rng_t *rng, float *out, size_t count)
 {
-	return RNG_SetRelative(rng, offset * sizeof(int8_t), &x, sizeof(int8_t));
+	uint64_t words[RNG_BULK_BLOCK];
+	rng_bulk_ctx_t bulk;
+	size_t i;
+	size_t n;
+
+	RNG_BulkKey(rng, bulk.key);
+	bulk.backend = rng->backend;
+
+	for (i = 0; i < count; i += n)
+	{
+		n = (count - i < RNG_BULK_BLOCK) ? count - i : RNG_BULK_BLOCK;
+		bulk.backend->bulk_u64(bulk.key, i, words, n);
+		RNG_BulkToFloat32(&bulk, words, i, &out[i], n);
+	}
 }
-int RNG_GetRelative(rng_t *rng, uint32_t offset, void *data, uint32_t size)
+
+void RNG_Fillf64(rng_t *rng, double *out, size_t count)
 {
-	uint32_t user_size = rng->state_size - rng->id_length - sizeof(uint64_t) * 4;
+	uint64_t words[RNG_BULK_BLOCK];
+	rng_bulk_ctx_t bulk;
+	size_t i;
+	size_t n;
 
-	if (offset > user_size)
-		return -1;
-	if (offset < size)
-		return -1;
+	RNG_BulkKey(rng, bulk.key);
+	bulk.backend = rng->backend;
+
+	for (i = 0; i < count; i += n)
+	{
+		n = (count - i < RNG_BULK_BLOCK) ? count - i : RNG_BULK_BLOCK;
+		bulk.backend->bulk_u64(bulk.key, i, words, n);
+		RNG_BulkToFloat64(&bulk, words, i, &out[i], n);
+	}
+}
 
-	memcpy(data, &rng->state[(uint32_t)sizeof(uint64_t) * 4 + rng->id_length + (user_size - offset)], size);
+/*
+	Thread-local RNG.
 
-	return 0;
+	Every thread has an implicit RNG of its own, set up by its first RNG_Tls* call exactly as RNG_New would
+	and kept in thread-local storage, so that no rng_t has to be created or passed around and no two threads
+	ever touch the same state. Its counter comes from the one lock-free reservation RNG_New makes.
+	Thread-local storage runs no destructors, so setting up the RNG also stores its address in a pthread
+	key (a fiber-local slot on Windows) whose destructor destroys it when the thread exits.
+*/
+static THREAD_LOCAL rng_t g_rng_tls;	// all zero until first use, and after RNG_TlsDestroy
+
+static spinlock_t g_rng_tls_lock = SPINLOCK_INIT;	// guards the creation of g_rng_tls_key
+static atomic_u32_t g_rng_tls_key_state = 0;		// 0 until the key is created, 1 once it is, 2 if that failed
+#if defined(_MSC_VER)
+static DWORD g_rng_tls_key;
+#else
+static pthread_key_t g_rng_tls_key;
+#endif
+
+#if defined(_MSC_VER)
+static VOID WINAPI RNG_TlsExit(PVOID rng)
+#else
+static void RNG_TlsExit(void *rng)
+#endif
+{
+	if (rng && ((rng_t*)rng)->backend)
+		RNG_Destroy((rng_t*)rng);
 }
+// Arranges for the calling thread's implicit RNG to be destroyed when the thread exits. Without a key the
+// RNG still works, and is only leaked as before.
+static void RNG_TlsRegister(void)
+{
+	uint32_t key_state = ATOMIC_LOAD_U32(&g_rng_tls_key_state);
 
-int RNG_GetRelativeu64(rng_t *rng, uint32_t offset, uint64_t *x)
+	if (!key_state)
+	{
+		RNG_Lock(&g_rng_tls_lock);
+		key_state = ATOMIC_LOAD_U32(&g_rng_tls_key_state);
+		if (!key_state)
+		{
+#if defined(_MSC_VER)
+			g_rng_tls_key = FlsAlloc(RNG_TlsExit);
+			key_state = (g_rng_tls_key != FLS_OUT_OF_INDEXES) ? 1 : 2;
+#else
+			key_state = pthread_key_create(&g_rng_tls_key, RNG_TlsExit) ? 2 : 1;
+#endif
+			ATOMIC_EXCHANGE_U32(&g_rng_tls_key_state, key_state);
+		}
+		SpinLock_Unlock(&g_rng_tls_lock);
+	}
+	if (key_state != 1)
+		return;
+
+#if defined(_MSC_VER)
+	FlsSetValue(g_rng_tls_key, &g_rng_tls);
+#else
+	pthread_setspecific(g_rng_tls_key, &g_rng_tls);
+#endif
+}
+static INLINE_DEF rng_t *RNG_TlsLocal(void)
 {
-	return RNG_GetRelative(rng, offset * sizeof(uint64_t), x, sizeof(uint64_t));
+	if (!g_rng_tls.backend)
+	{
+		g_rng_tls = RNG_New();
+		RNG_TlsRegister();
+	}
+
+	return &g_rng_tls;
 }
-int RNG_GetRelativeu32(rng_t *rng, uint32_t offset, uint32_t *x)
+rng_t *RNG_TlsGet(void)
 {
-	return RNG_GetRelative(rng, offset * sizeof(uint32_t), x, sizeof(uint32_t));
+	return RNG_TlsLocal();
 }
-int RNG_GetRelativeu16(rng_t *rng, uint32_t offset, uint16_t *x)
+void RNG_TlsDestroy(void)
 {
-	return RNG_GetRelative(rng, offset * sizeof(uint16_t), x, sizeof(uint16_t));
+	if (g_rng_tls.backend)
+		RNG_Destroy(&g_rng_tls);
 }
-int RNG_GetRelativeu8(rng_t *rng, uint32_t offset, uint8_t *x)
+uint64_t RNG_TlsRandomu64(void)
 {
-	return RNG_GetRelative(rng, offset * sizeof(uint8_t), x, sizeof(uint8_t));
+	return RNG_Randomu64(RNG_TlsLocal());
 }
-int RNG_GetRelativei64(rng_t *rng, int32_t offset, int64_t *x)
+float RNG_TlsRandomf32(void)
 {
-	return RNG_GetRelative(rng, offset * sizeof(int64_t), x, sizeof(int64_t));
+	return RNG_Randomf32(RNG_TlsLocal());
 }
-int RNG_GetRelativei32(rng_t *rng, int32_t offset, int32_t *x)
+double RNG_TlsRandomf64(void)
 {
-	return RNG_GetRelative(rng, offset * sizeof(int32_t), x, sizeof(int32_t));
+	return RNG_Randomf64(RNG_TlsLocal());
 }
-int RNG_GetRelativei16(rng_t *rng, int32_t offset, int16_t *x)
+int RNG_TlsPush(void *data, uint32_t size)
 {
-	return RNG_GetRelative(rng, offset * sizeof(int16_t), x, sizeof(int16_t));
+	return RNG_Push(RNG_TlsLocal(), data, size);
 }
-int RNG_GetRelativei8(rng_t *rng, int32_t offset, int8_t *x)
+int RNG_TlsPushu64(uint64_t x)
 {
-	return RNG_GetRelative(rng, offset * sizeof(int8_t), x, sizeof(int8_t));
+	return RNG_Pushu64(RNG_TlsLocal(), x);
 }
-int RNG_Push(rng_t *rng, void *data, uint32_t size)
+int RNG_TlsPop(void *data, uint32_t size)
 {
-	if (RNG_ExpandStateBuffer(rng, size, RNG_EXPAND_USER))
-		return -1; // valid RNG but without value pushed
+	return RNG_Pop(RNG_TlsLocal(), data, size);
+}
+int RNG_TlsPopu64(uint64_t *x)
+{
+	return RNG_Popu64(RNG_TlsLocal(), x);
+}
 
-	if (data)
-		memcpy(&rng->state[rng->state_size], data, size);
+/*
+	Shared RNG handles.
 
-	rng->state_size += size;
+	A shared handle is a snapshot of an RNG's stream key plus a draw index that every draw advances with one
+	atomic fetch-add, so any number of threads can draw from it at once without a lock and never receive the
+	same stream value twice. Draw p is stream value p of the snapshotted state, so a single thread drawing
+	from a new handle sees exactly what RNG_MODE_STREAM returns for that state from position 0. The index
+	lives on its own cache line so that draws do not keep invalidating the read-only key.
+*/
+struct rng_shared_s
+{
+	const rng_backend_t	*backend;
+	uint64_t			key[2];
+	uint8_t				pad[RNG_CACHE_LINE - sizeof(const rng_backend_t*) - sizeof(uint64_t) * 2];
+	atomic_u64_t		position;
+};
 
-	return 0;
+// Float words, retries included, each take the next position, as RNG_StreamWord does.
+static uint64_t RNG_SharedWord(void *ctx, uint32_t index)
+{
+	rng_shared_t *shared = (rng_shared_t*)ctx;
+	uint64_t word;
+
+	if (index)
+		RNG_STAT_ADD(0, float_retries, 1);
+	shared->backend->bulk_u64(shared->key, ATOMIC_FETCH_ADD_U64(&shared->position, 1), &word, 1);
+
+	return word;
 }
+rng_shared_t *RNG_SharedNew(rng_t *rng)
+{
+	rng_shared_t *shared;
 
-int RNG_Pushu64(rng_t *rng, uint64_t x)
+	if (!RNG_IsValid(rng))
+		return 0;
+
+	shared = Mem_AlignedMalloc(sizeof(rng_shared_t), RNG_CACHE_LINE);
+	if (!shared)
+		return 0;
+
+	shared->backend = rng->backend;
+	RNG_BulkKey(rng, shared->key);
+	ATOMIC_STORE_U64(&shared->position, 0);
+
+	return shared;
+}
+void RNG_SharedDestroy(rng_shared_t *shared)
 {
-	return RNG_Push(rng, &x, (uint32_t)sizeof(uint64_t));
+	Mem_AlignedFree(shared);
 }
-int RNG_Pushu32(rng_t *rng, uint32_t x)
+uint64_t RNG_SharedRandomu64(rng_shared_t *shared)
 {
-	return RNG_Push(rng, &x, (uint32_t)sizeof(uint32_t));
+	uint64_t word;
+
+	shared->backend->bulk_u64(shared->key, ATOMIC_FETCH_ADD_U64(&shared->position, 1), &word, 1);
+
+	return word;
 }
-int RNG_Pushu16(rng_t *rng, uint16_t x)
+float RNG_SharedRandomf32(rng_shared_t *shared)
 {
-	return RNG_Push(rng, &x, (uint32_t)sizeof(uint16_t));
+	return RNG_MakeFloat32(RNG_SharedWord, shared);
 }
-int RNG_Pushu8(rng_t *rng, uint8_t x)
+double RNG_SharedRandomf64(rng_shared_t *shared)
 {
-	return RNG_Push(rng, &x, (uint32_t)sizeof(uint8_t));
+	return RNG_MakeFloat64(RNG_SharedWord, shared);
+}
+// One fetch-add claims the whole block, so the block is count consecutive stream values.
+void RNG_SharedFillu64(rng_shared_t *shared, uint64_t *out, size_t count)
+{
+	if (count)
+		shared->backend->bulk_u64(shared->key, ATOMIC_FETCH_ADD_U64(&shared->position, count), out, count);
+}
+uint64_t RNG_SharedGetPosition(rng_shared_t *shared)
+{
+	return ATOMIC_LOAD_U64(&shared->position);
+}
+
+/*
+	RNG banks.
+
+	For states of up to XXH3_MIDSIZE_MAX bytes, XXH3-128 is a short fixed sequence of XXH128_mix32B rounds
+	whose input offsets depend only on the length, so a bank precomputes that sequence once per call and
+	runs every round across all lanes of a group. The 64x64->128 multiplies cannot be vectorised on x86,
+	but the lanes are independent, so the multiplies of one round overlap instead of forming a single
+	dependency chain. Longer states are gathered and hashed one lane at a time.
+*/
+
+typedef struct rng_bank_step_s
+{
+	uint32_t	in1;
+	uint32_t	in2;
+	uint64_t	secret[4];
+}rng_bank_step_t;
+
+static INLINE_DEF void RNG_BankAddStep(rng_bank_step_t *step, uint32_t in1, uint32_t in2, uint32_t secret_offset)
+{
+	step->in1 = in1;
+	step->in2 = in2;
+	step->secret[0] = XXH_readLE64(&XXH3_kSecret[secret_offset]);
+	step->secret[1] = XXH_readLE64(&XXH3_kSecret[secret_offset + 8]);
+	step->secret[2] = XXH_readLE64(&XXH3_kSecret[secret_offset + 16]);
+	step->secret[3] = XXH_readLE64(&XXH3_kSecret[secret_offset + 24]);
+}
+
+// Mirrors XXH3_len_17to128_128b and XXH3_len_129to240_128b for seed 0. Returns the number of rounds, and
+// the number of rounds after which both accumulators are avalanched (0 for none) in "avalanche_after".
+static uint32_t RNG_BankPlan(uint32_t len, rng_bank_step_t *steps, uint32_t *avalanche_after)
+{
+	uint32_t n = 0;
+	uint32_t i;
+
+	*avalanche_after = 0;
+
+	if (len <= 128)
+	{
+		if (len > 96)
+			RNG_BankAddStep(&steps[n++], 48, len - 64, 96);
+		if (len > 64)
+			RNG_BankAddStep(&steps[n++], 32, len - 48, 64);
+		if (len > 32)
+			RNG_BankAddStep(&steps[n++], 16, len - 32, 32);
+		RNG_BankAddStep(&steps[n++], 0, len - 16, 0);
+	}
+	else
+	{
+		for (i = 0; i < 4; i++)
+			RNG_BankAddStep(&steps[n++], 32 * i, 32 * i + 16, 32 * i);
+		*avalanche_after = n;
+		for (i = 4; i < len / 32; i++)
+			RNG_BankAddStep(&steps[n++], 32 * i, 32 * i + 16, XXH3_MIDSIZE_STARTOFFSET + 32 * (i - 4));
+		RNG_BankAddStep(&steps[n++], len - 16, len - 32, XXH3_SECRET_SIZE_MIN - XXH3_MIDSIZE_LASTOFFSET - 16);
+	}
+
+	return n;
 }
-int RNG_Pushi64(rng_t *rng, int64_t x)
+
+// reads the 8 bytes at byte "offset" of one lane of a group
+static INLINE_DEF uint64_t RNG_BankRead64(const uint64_t *group, uint32_t offset, uint32_t lane)
 {
-	return RNG_Push(rng, &x, (uint32_t)sizeof(int64_t));
+	const uint64_t *w = &group[(offset >> 3) * RNG_BANK_LANES + lane];
+	uint32_t shift = (offset & 7) * 8;
+
+	if (shift == 0)
+		return w[0];
+	else
+		return (w[0] >> shift) | (w[RNG_BANK_LANES] << (64 - shift));
 }
-int RNG_Pushi32(rng_t *rng, int32_t x)
+
+static INLINE_DEF uint64_t *RNG_BankGroup(rng_bank_t *bank, uint32_t lane)
 {
-	return RNG_Push(rng, &x, (uint32_t)sizeof(int32_t));
+	return &bank->words[(size_t)(lane / RNG_BANK_LANES) * bank->word_count * RNG_BANK_LANES];
 }
-int RNG_Pushi16(rng_t *rng, int16_t x)
+
+// writes the same bytes into lanes [first, first + count), a whole word at a time
+static void RNG_BankWriteBytes(rng_bank_t *bank, uint32_t first, uint32_t count, uint32_t offset, const uint8_t *data, uint32_t size)
 {
-	return RNG_Push(rng, &x, (uint32_t)sizeof(int16_t));
+	uint64_t mask;
+	uint64_t value;
+	uint64_t *w;
+	uint32_t word;
+	uint32_t end = offset + size;
+	uint32_t i;
+	uint32_t l;
+
+	for (word = offset >> 3; word << 3 < end; word++)
+	{
+		mask = 0;
+		value = 0;
+		for (i = (word << 3 > offset) ? word << 3 : offset; (i < end) && (i < (word + 1) << 3); i++)
+		{
+			mask |= ((uint64_t)0xFF) << ((i & 7) * 8);
+			value |= ((uint64_t)data[i - offset]) << ((i & 7) * 8);
+		}
+
+		w = &RNG_BankGroup(bank, first)[word * RNG_BANK_LANES];
+		for (l = first; l < first + count; l++)
+		{
+			w[l % RNG_BANK_LANES] = (w[l % RNG_BANK_LANES] & ~mask) | value;
+			if (l % RNG_BANK_LANES == RNG_BANK_LANES - 1)
+				w += (size_t)bank->word_count * RNG_BANK_LANES;
+		}
+	}
 }
-int RNG_Pushi8(rng_t *rng, int8_t x)
+
+// copies one lane into bank->scratch as a contiguous state
+static uint8_t *RNG_BankGather(rng_bank_t *bank, uint32_t lane)
 {
-	return RNG_Push(rng, &x, (uint32_t)sizeof(int8_t));
+	const uint64_t *group = RNG_BankGroup(bank, lane);
+	uint32_t i;
+
+	for (i = 0; i < bank->word_count; i++)
+		XXH_writeLE64(&bank->scratch[i * sizeof(uint64_t)], group[i * RNG_BANK_LANES + (lane % RNG_BANK_LANES)]);
+
+	return bank->scratch;
 }
 
-int RNG_Pop(rng_t *rng, void *data, uint32_t size)
+// Computes the seed 0 hash of lanes [first, first + count) into out[0 .. count - 1]. "first" must be a
+// multiple of RNG_BANK_LANES.
+static void RNG_BankHash64(rng_bank_t *bank, uint32_t first, uint32_t count, uint64_t *out)
 {
-	if (rng->state_size < size + (uint32_t)sizeof(uint64_t)*4 + rng->id_length)
-		return -1;
-	
-	if (data)
-		memcpy(data, &rng->state[rng->state_size - size], size);
-	
-	rng->state_size -= size;
+	rng_bank_step_t steps[RNG_BANK_MAX_STEPS];
+	uint64_t acc_lo[RNG_BANK_LANES];
+	uint64_t acc_hi[RNG_BANK_LANES];
+	const uint64_t *group;
+	const rng_bank_step_t *step;
+	uint64_t a0, a1, b0, b1;
+	uint32_t avalanche_after;
+	uint32_t nsteps;
+	int aligned = (bank->state_size & 7) == 0;
+	uint32_t g;
+	uint32_t i;
+	uint32_t l;
 
-	return 0;
+	RNG_STAT_ADD(0, hash_calls, count);
+	RNG_STAT_ADD(0, hash_bytes, (uint64_t)count * bank->state_size);
+
+	if (bank->state_size > XXH3_MIDSIZE_MAX)
+	{
+		for (i = 0; i < count; i++)
+			out[i] = HASH_FUNCTION64(RNG_BankGather(bank, first + i), bank->state_size, 0);
+		return;
+	}
+
+	nsteps = RNG_BankPlan(bank->state_size, steps, &avalanche_after);
+
+	for (g = 0; g < count; g += RNG_BANK_LANES)
+	{
+		group = RNG_BankGroup(bank, first + g);
+
+		for (l = 0; l < RNG_BANK_LANES; l++)
+		{
+			acc_lo[l] = bank->state_size * XXH_PRIME64_1;
+			acc_hi[l] = 0;
+		}
+
+		for (i = 0; i < nsteps; i++)
+		{
+			step = &steps[i];
+
+			if (aligned)
+			{
+				// every offset is a whole word, so each input is one contiguous row of lanes
+				const uint64_t *a = &group[(step->in1 >> 3) * RNG_BANK_LANES];
+				const uint64_t *b = &group[(step->in2 >> 3) * RNG_BANK_LANES];
+
+				for (l = 0; l < RNG_BANK_LANES; l++)
+				{
+					acc_lo[l] += XXH3_mul128_fold64(a[l] ^ step->secret[0], a[l + RNG_BANK_LANES] ^ step->secret[1]);
+					acc_lo[l] ^= b[l] + b[l + RNG_BANK_LANES];
+					acc_hi[l] += XXH3_mul128_fold64(b[l] ^ step->secret[2], b[l + RNG_BANK_LANES] ^ step->secret[3]);
+					acc_hi[l] ^= a[l] + a[l + RNG_BANK_LANES];
+				}
+			}
+			else
+			{
+				for (l = 0; l < RNG_BANK_LANES; l++)
+				{
+					a0 = RNG_BankRead64(group, step->in1, l);
+					a1 = RNG_BankRead64(group, step->in1 + 8, l);
+					b0 = RNG_BankRead64(group, step->in2, l);
+					b1 = RNG_BankRead64(group, step->in2 + 8, l);
+
+					acc_lo[l] += XXH3_mul128_fold64(a0 ^ step->secret[0], a1 ^ step->secret[1]);
+					acc_lo[l] ^= b0 + b1;
+					acc_hi[l] += XXH3_mul128_fold64(b0 ^ step->secret[2], b1 ^ step->secret[3]);
+					acc_hi[l] ^= a0 + a1;
+				}
+			}
+
+			if (i + 1 == avalanche_after)
+			{
+				for (l = 0; l < RNG_BANK_LANES; l++)
+				{
+					acc_lo[l] = XXH3_avalanche(acc_lo[l]);
+					acc_hi[l] = XXH3_avalanche(acc_hi[l]);
+				}
+			}
+		}
+
+		for (l = 0; (l < RNG_BANK_LANES) && (g + l < count); l++)
+			out[g + l] = XXH3_avalanche(acc_lo[l] + acc_hi[l]);
+	}
 }
-int RNG_Popu64(rng_t *rng, uint64_t *x)
+
+// Every RNG must be valid, use an XXH3-128 state hash and have the same total stack depth, and the bank
+// takes a copy of their states. On failure, a non-valid bank is returned.
+rng_bank_t RNG_BankNew(rng_t *rngs, uint32_t count)
 {
-	return RNG_Pop(rng, x, (uint32_t)sizeof(uint64_t));
+	rng_bank_t bank;
+	uint32_t groups;
+	uint32_t i;
+
+	memset(&bank, 0, sizeof(rng_bank_t));
+
+	if (!rngs || count == 0)
+		return bank;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!RNG_IsValid(&rngs[i]))
+			return bank;
+		if (rngs[i].state_size != rngs[0].state_size || rngs[i].id_length != rngs[0].id_length)
+			return bank;
+		if ((rngs[i].backend->hash128 != RNG_XXH3_Hash128) || (rngs[i].layout != RNG_LAYOUT_FLAT))
+			return bank;
+	}
+
+	bank.count = count;
+	bank.state_size = rngs[0].state_size;
+	bank.user_offset = (uint32_t)sizeof(uint64_t) * 4 + rngs[0].id_length;
+	bank.word_count = (bank.state_size + (uint32_t)sizeof(uint64_t) - 1) / (uint32_t)sizeof(uint64_t) + 1;
+
+	groups = (count + RNG_BANK_LANES - 1) / RNG_BANK_LANES;
+	bank.words = Mem_AlignedMalloc((size_t)groups * bank.word_count * RNG_BANK_LANES * sizeof(uint64_t), RNG_BANK_ALIGN);
+	bank.scratch = MALLOC_FUNC((size_t)bank.word_count * sizeof(uint64_t));
+	if (!bank.words || !bank.scratch)
+	{
+		RNG_BankDestroy(&bank);
+		return bank;
+	}
+	memset(bank.words, 0, (size_t)groups * bank.word_count * RNG_BANK_LANES * sizeof(uint64_t));
+
+	for (i = 0; i < count; i++)
+		RNG_BankWriteBytes(&bank, i, 1, 0, RNG_StateData(&rngs[i]), bank.state_size);
+
+	return bank;
 }
-int RNG_Popu32(rng_t *rng, uint32_t *x)
+
+void RNG_BankDestroy(rng_bank_t *bank)
 {
-	return RNG_Pop(rng, x, (uint32_t)sizeof(uint32_t));
+	if (!bank)
+		return;
+	Mem_AlignedFree(bank->words);
+	FREE_FUNC(bank->scratch);
+	memset(bank, 0, sizeof(rng_bank_t));
 }
-int RNG_Popu16(rng_t *rng, uint16_t *x)
+
+int RNG_BankIsValid(rng_bank_t *bank)
 {
-	return RNG_Pop(rng, x, (uint32_t)sizeof(uint16_t));
+	return (bank->words != 0 && bank->count != 0) ? 1 : 0;
 }
-int RNG_Popu8(rng_t *rng, uint8_t *x)
+
+uint32_t RNG_BankGetCount(rng_bank_t *bank)
 {
-	return RNG_Pop(rng, x, (uint32_t)sizeof(uint8_t));
+	return bank->count;
 }
-int RNG_Popi64(rng_t *rng, int64_t *x)
+
+int RNG_BankSetRelativeLane(rng_bank_t *bank, uint32_t lane, uint32_t offset, void *data, uint32_t size)
 {
-	return RNG_Pop(rng, x, (uint32_t)sizeof(int64_t));
+	uint32_t user_size = bank->state_size - bank->user_offset;
+
+	if (lane >= bank->count)
+		return -1;
+	if (offset > user_size)
+		return -1;
+	if (offset < size)
+		return -1;
+
+	RNG_BankWriteBytes(bank, lane, 1, bank->user_offset + (user_size - offset), (const uint8_t*)data, size);
+
+	return 0;
 }
-int RNG_Popi32(rng_t *rng, int32_t *x)
+
+int RNG_BankSetRelative(rng_bank_t *bank, uint32_t offset, void *data, uint32_t size)
 {
-	return RNG_Pop(rng, x, (uint32_t)sizeof(int32_t));
+	uint32_t user_size = bank->state_size - bank->user_offset;
+
+	if (offset > user_size)
+		return -1;
+	if (offset < size)
+		return -1;
+
+	RNG_BankWriteBytes(bank, 0, bank->count, bank->user_offset + (user_size - offset), (const uint8_t*)data, size);
+
+	return 0;
 }
-int RNG_Popi16(rng_t *rng, int16_t *x)
+
+int RNG_BankSetRelativeu64(rng_bank_t *bank, uint32_t offset, uint64_t x)
 {
-	return RNG_Pop(rng, x, (uint32_t)sizeof(int16_t));
+	return RNG_BankSetRelative(bank, offset * sizeof(uint64_t), &x, sizeof(uint64_t));
 }
-int RNG_Popi8(rng_t *rng, int8_t *x)
+
+void RNG_BankRandomu64(rng_bank_t *bank, uint64_t *out)
 {
-	return RNG_Pop(rng, x, (uint32_t)sizeof(int8_t));
+	RNG_BankHash64(bank, 0, bank->count, out);
 }
-void RNG_ResetStack(rng_t *rng)
+
+// The lane kernel supplies word 0 of every float. Lanes that need more words are gathered and finished
+// by the scalar constructor, which rehashes word 0 but is only reached with probability 2^-40 or less.
+void RNG_BankRandomf32(rng_bank_t *bank, float *out)
 {
-	rng->state_size = (uint32_t)sizeof(uint64_t)*4 + rng->id_length;
+	uint64_t words[RNG_BULK_BLOCK];
+	rng_flat_ctx_t lane;
+	uint32_t first;
+	uint32_t n;
+	uint32_t cnt;
+	uint32_t m;
+	uint32_t i;
+
+	for (first = 0; first < bank->count; first += RNG_BULK_BLOCK)
+	{
+		n = (bank->count - first < RNG_BULK_BLOCK) ? bank->count - first : RNG_BULK_BLOCK;
+		RNG_BankHash64(bank, first, n, words);
+		for (i = 0; i < n; i++)
+		{
+			cnt = (uint32_t)Math_LZCnt64(words[i]);
+			if (RNG_HASH_BITS - cnt - 1 >= FP32_MANTISSA_BITS)
+			{
+				m = (((1 << (FP32_EXPONENT_BITS - 1)) - 2 - cnt) << FP32_MANTISSA_BITS) | ((uint32_t)words[i] & FP32_MANTISSA_MASK);
+				memcpy(&out[first + i], &m, sizeof(float));
+			}
+			else
+			{
+				lane.backend = &RNG_BACKEND_XXH3_128;
+				lane.state = RNG_BankGather(bank, first + i);
+				lane.size = bank->state_size;
+				out[first + i] = RNG_MakeFloat32(RNG_FlatWord, &lane);
+			}
+		}
+	}
 }
 
-uint64_t RNG_Randomu64(rng_t *rng)
+void RNG_BankRandomf64(rng_bank_t *bank, double *out)
 {
-	return (uint64_t)HASH_FUNCTION64(rng->state, rng->state_size, 0);
+	uint64_t words[RNG_BULK_BLOCK];
+	rng_flat_ctx_t lane;
+	uint32_t first;
+	uint32_t n;
+	uint32_t cnt;
+	uint64_t m;
+	uint32_t i;
+
+	for (first = 0; first < bank->count; first += RNG_BULK_BLOCK)
+	{
+		n = (bank->count - first < RNG_BULK_BLOCK) ? bank->count - first : RNG_BULK_BLOCK;
+		RNG_BankHash64(bank, first, n, words);
+		for (i = 0; i < n; i++)
+		{
+			cnt = (uint32_t)Math_LZCnt64(words[i]);
+			if (RNG_HASH_BITS - cnt - 1 >= FP64_MANTISSA_BITS)
+			{
+				m = ((((uint64_t)1 << (FP64_EXPONENT_BITS - 1)) - 2 - cnt) << FP64_MANTISSA_BITS) | (words[i] & FP64_MANTISSA_MASK);
+				memcpy(&out[first + i], &m, sizeof(double));
+			}
+			else
+			{
+				lane.backend = &RNG_BACKEND_XXH3_128;
+				lane.state = RNG_BankGather(bank, first + i);
+				lane.size = bank->state_size;
+				out[first + i] = RNG_MakeFloat64(RNG_FlatWord, &lane);
+			}
+		}
+	}
 }
-uint32_t RNG_Randomu32(rng_t *rng)
+
+/*
+	Key sweeps.
+
+	A sweep evaluates the state once per key with one 64-bit stack slot replaced by the key, without writing
+	the keys into the state. For XXH3 states of up to XXH3_MIDSIZE_MAX bytes, every XXH128_mix32B round
+	whose 32 input bytes do not overlap the slot is computed once, and per key only the rounds that read
+	the slot redo their multiplies; the keys are independent so consecutive keys overlap in the pipeline.
+	Longer states with a streaming backend absorb the bytes below the slot once and, per key, only the
+	slot and the bytes above it. Anything else patches the slot in place and restores it afterwards.
+*/
+
+typedef struct rng_sweep_step_s
 {
-	return (uint32_t)HASH_FUNCTION64(rng->state, rng->state_size, 0);
-}
-uint16_t RNG_Randomu16(rng_t *rng)
+	uint64_t	base[4];					// a0, a1, b0, b1 with the slot bytes cleared
+	uint64_t	key_mask[4];				// which bits of (key >> key_shr) << key_shl land in each word
+	uint8_t		key_shr[4];
+	uint8_t		key_shl[4];
+	uint64_t	secret[4];
+	uint64_t	mix_lo;						// XXH3_mix16B of input 1 and the sum of input 2, when constant
+	uint64_t	sum_lo;
+	uint64_t	mix_hi;
+	uint64_t	sum_hi;
+	int			a_varies;
+	int			b_varies;
+}rng_sweep_step_t;
+
+static INLINE_DEF void RNG_SweepRead(rng_sweep_step_t *step, uint32_t k, const uint8_t *state, uint32_t offset, uint32_t pos)
 {
-	return (uint16_t)HASH_FUNCTION64(rng->state, rng->state_size, 0);
+	int32_t d = (int32_t)pos - (int32_t)offset;
+	uint64_t word = XXH_readLE64(&state[offset]);
+	uint64_t mask;
+
+	step->key_shr[k] = 0;
+	step->key_shl[k] = 0;
+	step->key_mask[k] = 0;
+
+	if (d <= -(int32_t)sizeof(uint64_t) || d >= (int32_t)sizeof(uint64_t))
+	{
+		step->base[k] = word;
+		return;
+	}
+
+	if (d >= 0)
+	{
+		step->key_shl[k] = (uint8_t)(d * 8);
+		mask = ~((uint64_t)0) << (d * 8);
+	}
+	else
+	{
+		step->key_shr[k] = (uint8_t)(-d * 8);
+		mask = ~((uint64_t)0) >> (-d * 8);
+	}
+	step->key_mask[k] = mask;
+	step->base[k] = word & ~mask;
 }
-uint8_t RNG_Randomu8(rng_t *rng)
+
+static INLINE_DEF uint64_t RNG_SweepWord(const rng_sweep_step_t *step, uint32_t k, uint64_t key)
 {
-	return (uint8_t)HASH_FUNCTION64(rng->state, rng->state_size, 0);
+	return step->base[k] | (((key >> step->key_shr[k]) << step->key_shl[k]) & step->key_mask[k]);
 }
 
-int64_t RNG_Randomi64(rng_t *rng)
+// seed 0 XXH3-128 low halves of a state of 17 to XXH3_MIDSIZE_MAX bytes with the 8 bytes at "pos" replaced
+static void RNG_SweepMidsize(const uint8_t *state, uint32_t len, uint32_t pos, const uint64_t *keys, size_t n, uint64_t *out)
 {
-	return (int64_t)HASH_FUNCTION64(rng->state, rng->state_size, 0);
+	rng_bank_step_t plan[RNG_BANK_MAX_STEPS];
+	rng_sweep_step_t steps[RNG_BANK_MAX_STEPS];
+	rng_sweep_step_t *step;
+	uint64_t acc_lo, acc_hi;
+	uint64_t a0, a1, b0, b1;
+	uint64_t key;
+	uint64_t sum_a;
+	uint32_t avalanche_after;
+	uint32_t nsteps;
+	uint32_t i;
+	size_t j;
+
+	nsteps = RNG_BankPlan(len, plan, &avalanche_after);
+
+	for (i = 0; i < nsteps; i++)
+	{
+		step = &steps[i];
+		RNG_SweepRead(step, 0, state, plan[i].in1, pos);
+		RNG_SweepRead(step, 1, state, plan[i].in1 + 8, pos);
+		RNG_SweepRead(step, 2, state, plan[i].in2, pos);
+		RNG_SweepRead(step, 3, state, plan[i].in2 + 8, pos);
+		memcpy(step->secret, plan[i].secret, sizeof(step->secret));
+
+		step->a_varies = (step->key_mask[0] | step->key_mask[1]) != 0;
+		step->b_varies = (step->key_mask[2] | step->key_mask[3]) != 0;
+		step->mix_lo = XXH3_mul128_fold64(step->base[0] ^ step->secret[0], step->base[1] ^ step->secret[1]);
+		step->sum_hi = step->base[0] + step->base[1];
+		step->mix_hi = XXH3_mul128_fold64(step->base[2] ^ step->secret[2], step->base[3] ^ step->secret[3]);
+		step->sum_lo = step->base[2] + step->base[3];
+	}
+
+	for (j = 0; j < n; j++)
+	{
+		// the key's bytes as they appear in the state, which is how RNG_SetRelativeu64 stores it
+		key = XXH_readLE64(&keys[j]);
+		acc_lo = len * XXH_PRIME64_1;
+		acc_hi = 0;
+
+		for (i = 0; i < nsteps; i++)
+		{
+			step = &steps[i];
+
+			if (step->a_varies)
+			{
+				a0 = RNG_SweepWord(step, 0, key);
+				a1 = RNG_SweepWord(step, 1, key);
+				acc_lo += XXH3_mul128_fold64(a0 ^ step->secret[0], a1 ^ step->secret[1]);
+				sum_a = a0 + a1;
+			}
+			else
+			{
+				acc_lo += step->mix_lo;
+				sum_a = step->sum_hi;
+			}
+
+			if (step->b_varies)
+			{
+				b0 = RNG_SweepWord(step, 2, key);
+				b1 = RNG_SweepWord(step, 3, key);
+				acc_lo ^= b0 + b1;
+				acc_hi += XXH3_mul128_fold64(b0 ^ step->secret[2], b1 ^ step->secret[3]);
+			}
+			else
+			{
+				acc_lo ^= step->sum_lo;
+				acc_hi += step->mix_hi;
+			}
+
+			acc_hi ^= sum_a;
+
+			if (i + 1 == avalanche_after)
+			{
+				acc_lo = XXH3_avalanche(acc_lo);
+				acc_hi = XXH3_avalanche(acc_hi);
+			}
+		}
+
+		out[j] = XXH3_avalanche(acc_lo + acc_hi);
+	}
 }
-int32_t RNG_Randomi32(rng_t *rng)
+
+// Long states: the streaming state below the slot is built once, starting from the deepest checkpoint
+// that lies below it, and copied for every key.
+static int RNG_SweepStream(rng_t *rng, uint32_t pos, const uint64_t *keys, size_t n, uint64_t *out)
 {
-	return (int32_t)HASH_FUNCTION64(rng->state, rng->state_size, 0);
+	const rng_backend_t *backend = rng->backend;
+	size_t stride = RNG_CheckpointStride(backend);
+	uint8_t *prefix;
+	uint8_t *ctx;
+	uint64_t h[2];
+	uint32_t offset = 0;
+	uint32_t k;
+	size_t j;
+
+	prefix = Mem_AlignedMalloc(stride * 2, RNG_CHECKPOINT_ALIGN);
+	if (!prefix)
+		return -1;
+	ctx = &prefix[stride];
+
+	k = rng->checkpoint_count;
+	while (k && (k * RNG_CHECKPOINT_INTERVAL > pos))
+		k--;
+	if (k)
+	{
+		memcpy(prefix, &((uint8_t*)rng->checkpoints)[(k - 1) * stride], stride);
+		offset = k * RNG_CHECKPOINT_INTERVAL;
+	}
+	else
+		backend->stream_reset(prefix, 0);
+	backend->stream_update(prefix, &RNG_StateData(rng)[offset], pos - offset);
+	RNG_STAT_ADD(rng, hash_calls, n);
+	RNG_STAT_ADD(rng, hash_bytes, (pos - offset) + (uint64_t)n * (rng->state_size - pos));
+
+	for (j = 0; j < n; j++)
+	{
+		memcpy(ctx, prefix, stride);
+		backend->stream_update(ctx, &keys[j], sizeof(uint64_t));
+		backend->stream_update(ctx, &RNG_StateData(rng)[pos + sizeof(uint64_t)], rng->state_size - pos - sizeof(uint64_t));
+		backend->stream_digest(ctx, h);
+		out[j] = h[0];
+	}
+
+	Mem_AlignedFree(prefix);
+
+	return 0;
 }
-int16_t RNG_Randomi16(rng_t *rng)
+
+// Returns the byte position in *state of the 64-bit slot "offset" as used by RNG_SetRelativeu64, or -1.
+static INLINE_DEF int64_t RNG_SweepSlot(rng_t *rng, uint32_t offset)
 {
-	return (int16_t)HASH_FUNCTION64(rng->state, rng->state_size, 0);
+	uint32_t user_size = rng->state_size - rng->id_length - (uint32_t)sizeof(uint64_t) * 4;
+	uint64_t bytes = (uint64_t)offset * sizeof(uint64_t);
+
+	if (bytes > user_size || bytes < sizeof(uint64_t))
+		return -1;
+
+	return (int64_t)sizeof(uint64_t) * 4 + rng->id_length + (user_size - bytes);
 }
-int8_t RNG_Randomi8(rng_t *rng)
+
+// Tree root of the state with "key" in the slot at "pos". Without an up-to-date tree (it could not be
+// allocated), the slot is patched in place and the root computed from scratch, which first gives a shared
+// state a private copy. Returns non-zero if that copy cannot be made.
+static int RNG_SweepTreeRoot(rng_t *rng, uint32_t pos, const uint64_t *key, uint64_t *root)
 {
-	return (int8_t)HASH_FUNCTION64(rng->state, rng->state_size, 0);
+	uint8_t saved[sizeof(uint64_t)];
+
+	if (RNG_TreeRoot(rng, root) == 0)
+	{
+		RNG_TreeRootPatched(rng, pos, key, root);
+		return 0;
+	}
+	if (RNG_UnshareState(rng))
+		return -1;
+
+	memcpy(saved, &RNG_StateData(rng)[pos], sizeof(uint64_t));
+	memcpy(&RNG_StateData(rng)[pos], key, sizeof(uint64_t));
+	RNG_TreeRootSegments(rng, rng->backend, RNG_StateData(rng), rng->state_size, 0, 0, root);
+	memcpy(&RNG_StateData(rng)[pos], saved, sizeof(uint64_t));
+
+	return 0;
 }
 
-float RNG_Randomf32(rng_t *rng)
+// Only the fallbacks that patch the slot in place unshare the state, so sweeping a clone normally keeps
+// it shared. Returns non-zero if a private copy was needed and could not be made.
+static int RNG_SweepHash64(rng_t *rng, uint32_t pos, const uint64_t *keys, size_t n, uint64_t *out)
 {
-	uint64_t current;
-	uint32_t cnt;
-	uint32_t pw2;    
-	uint32_t m;
-
-	current = HASH_FUNCTION64(rng->state, rng->state_size, 0);
-	cnt = (uint32_t)Math_LZCnt64(current);
-	pw2 = cnt;
+	uint8_t saved[sizeof(uint64_t)];
+	uint64_t root[2];
+	size_t j;
 
-	/*
-	// testing purposes
-	current = (current >> 41) | 0x3f800000;
-	return *(float*)&current - 1.0f;
-	*/
+	// each key only rehashes the leaves holding the slot and their ancestors
+	if (rng->layout == RNG_LAYOUT_TREE)
+	{
+		for (j = 0; j < n; j++)
+		{
+			if (RNG_SweepTreeRoot(rng, pos, &keys[j], root))
+				return -1;
+			out[j] = RNG_TreeFinal(rng, rng->backend, root, rng->state_size, 0).low64;
+		}
+		return 0;
+	}
 
-	if (cnt == RNG_HASH_BITS)
+	if ((rng->backend->hash128 == RNG_XXH3_Hash128) && (rng->state_size <= XXH3_MIDSIZE_MAX))
 	{
-		current = HASH_FUNCTION64(rng->state, rng->state_size, 1);
-		cnt = (uint32_t)Math_LZCnt64(current);
-		pw2 += cnt;
+		// counted as full hashes, although the rounds that do not read the slot are shared
+		RNG_SweepMidsize(RNG_StateData(rng), rng->state_size, pos, keys, n, out);
+		RNG_STAT_ADD(rng, hash_calls, n);
+		RNG_STAT_ADD(rng, hash_bytes, (uint64_t)n * rng->state_size);
+		return 0;
+	}
+	if (rng->backend->stream_reset && (rng->state_size >= RNG_CHECKPOINT_MIN_SIZE))
+	{
+		if (RNG_SweepStream(rng, pos, keys, n, out) == 0)
+			return 0;
 	}
 
-	// if less than "FP32_MANTISSA_BITS" bits left, we need to generate a new hash to fill the mantissa
-	if (RNG_HASH_BITS - cnt - 1 < FP32_MANTISSA_BITS)
+	// the state is restored byte for byte, so checkpoints and the reservoir stay valid
+	if (RNG_UnshareState(rng))
+		return -1;
+	memcpy(saved, &RNG_StateData(rng)[pos], sizeof(uint64_t));
+	for (j = 0; j < n; j++)
 	{
-		current = HASH_FUNCTION64(rng->state, rng->state_size, 2);
+		memcpy(&RNG_StateData(rng)[pos], &keys[j], sizeof(uint64_t));
+		out[j] = RNG_BackendHash128(rng->backend, RNG_StateData(rng), rng->state_size, 0).low64;
+		RNG_STAT_HASH(rng, rng->state_size);
 	}
+	memcpy(&RNG_StateData(rng)[pos], saved, sizeof(uint64_t));
 
-	if (pw2 < (uint32_t)((1 << (FP32_EXPONENT_BITS - 1)) - 2))
-		m = ((1 << (FP32_EXPONENT_BITS - 1)) - 2 - pw2) << FP32_MANTISSA_BITS;
-	else // subnormal
-		m = 0;
+	return 0;
+}
 
-	m |= FP32_MANTISSA_MASK & current;
+int RNG_SweepRelativeu64(rng_t *rng, uint32_t offset, const uint64_t *keys, size_t n, uint64_t *out)
+{
+	int64_t pos = RNG_SweepSlot(rng, offset);
+
+	if (pos < 0)
+		return -1;
 
-	return *((float*)&m);
+	return RNG_SweepHash64(rng, (uint32_t)pos, keys, n, out);
 }
 
-double RNG_Randomf64(rng_t *rng)
+// Floats take word 0 from the sweep; the rare keys that need more words are finished with flat hashes of
+// a patched copy of the state.
+int RNG_SweepRelativeu64f32(rng_t *rng, uint32_t offset, const uint64_t *keys, size_t n, float *out)
 {
-	uint64_t current;
-	int32_t cnt;
-	uint32_t pw2;    
-	// ceil((2^(ebits - 1) - 2) / 2^hashbits)
-	const uint32_t maxrec = ((uint32_t)(1 << (FP64_EXPONENT_BITS - 1)) - 2 + RNG_HASH_BITS - 1) >> RNG_HASH_BITS_LOG2;
-	uint64_t m;
-	uint32_t i;
+	uint64_t words[RNG_BULK_BLOCK];
+	rng_flat_ctx_t flat;
+	rng_root_ctx_t root;
+	uint8_t saved[sizeof(uint64_t)];
+	int64_t pos = RNG_SweepSlot(rng, offset);
+	uint32_t cnt;
+	uint32_t m;
+	size_t first;
+	size_t i;
+	size_t len;
 
-	current = HASH_FUNCTION64(rng->state, rng->state_size, 0);
-	cnt = (uint32_t)Math_LZCnt64(current);
-	pw2 = cnt;
+	if (pos < 0)
+		return -1;
 
-	for (i = 1; (i < maxrec) && (cnt == RNG_HASH_BITS); i++)
-	{
-		current = HASH_FUNCTION64(rng->state, rng->state_size, i);
-		cnt = (uint32_t)Math_LZCnt64(current);
-		pw2 += cnt;
-	}
+	flat.backend = rng->backend;
+	flat.size = rng->state_size;
+	root.backend = rng->backend;
+	root.size = rng->state_size;
 
-	// if less than "FP64_MANTISSA_BITS" bits left, we need to generate a new hash to fill the mantissa
-	if (RNG_HASH_BITS - cnt - 1 < FP64_MANTISSA_BITS)
+	for (first = 0; first < n; first += len)
 	{
-		current = HASH_FUNCTION64(rng->state, rng->state_size, i);
+		len = (n - first < RNG_BULK_BLOCK) ? n - first : RNG_BULK_BLOCK;
+		if (RNG_SweepHash64(rng, (uint32_t)pos, &keys[first], len, words))
+			return -1;
+		for (i = 0; i < len; i++)
+		{
+			cnt = (uint32_t)Math_LZCnt64(words[i]);
+			if (RNG_HASH_BITS - cnt - 1 >= FP32_MANTISSA_BITS)
+			{
+				m = (((1 << (FP32_EXPONENT_BITS - 1)) - 2 - cnt) << FP32_MANTISSA_BITS) | ((uint32_t)words[i] & FP32_MANTISSA_MASK);
+				memcpy(&out[first + i], &m, sizeof(float));
+			}
+			else if (rng->layout == RNG_LAYOUT_TREE)
+			{
+				if (RNG_SweepTreeRoot(rng, (uint32_t)pos, &keys[first + i], root.root))
+					return -1;
+				out[first + i] = RNG_MakeFloat32(RNG_RootWord, &root);
+			}
+			else
+			{
+				// the slot is patched in place, so a shared state gets its private copy first
+				if (RNG_UnshareState(rng))
+					return -1;
+				flat.state = RNG_StateData(rng);
+				memcpy(saved, &RNG_StateData(rng)[pos], sizeof(uint64_t));
+				memcpy(&RNG_StateData(rng)[pos], &keys[first + i], sizeof(uint64_t));
+				out[first + i] = RNG_MakeFloat32(RNG_FlatWord, &flat);
+				memcpy(&RNG_StateData(rng)[pos], saved, sizeof(uint64_t));
+			}
+		}
 	}
 
-	if (pw2 < (uint32_t)((1 << (FP64_EXPONENT_BITS - 1)) - 2))
-		m = ((((uint64_t)1) << (FP64_EXPONENT_BITS - 1)) - 2 - pw2) << FP64_MANTISSA_BITS;
-	else // subnormal
-		m = 0;
+	return 0;
+}
 
-	m |= FP64_MANTISSA_MASK & current;
+int RNG_SweepRelativeu64f64(rng_t *rng, uint32_t offset, const uint64_t *keys, size_t n, double *out)
+{
+	uint64_t words[RNG_BULK_BLOCK];
+	rng_flat_ctx_t flat;
+	rng_root_ctx_t root;
+	uint8_t saved[sizeof(uint64_t)];
+	int64_t pos = RNG_SweepSlot(rng, offset);
+	uint32_t cnt;
+	uint64_t m;
+	size_t first;
+	size_t i;
+	size_t len;
 
-	return *((double*)&m);
+	if (pos < 0)
+		return -1;
+
+	flat.backend = rng->backend;
+	flat.size = rng->state_size;
+	root.backend = rng->backend;
+	root.size = rng->state_size;
+
+	for (first = 0; first < n; first += len)
+	{
+		len = (n - first < RNG_BULK_BLOCK) ? n - first : RNG_BULK_BLOCK;
+		if (RNG_SweepHash64(rng, (uint32_t)pos, &keys[first], len, words))
+			return -1;
+		for (i = 0; i < len; i++)
+		{
+			cnt = (uint32_t)Math_LZCnt64(words[i]);
+			if (RNG_HASH_BITS - cnt - 1 >= FP64_MANTISSA_BITS)
+			{
+				m = ((((uint64_t)1 << (FP64_EXPONENT_BITS - 1)) - 2 - cnt) << FP64_MANTISSA_BITS) | (words[i] & FP64_MANTISSA_MASK);
+				memcpy(&out[first + i], &m, sizeof(double));
+			}
+			else if (rng->layout == RNG_LAYOUT_TREE)
+			{
+				if (RNG_SweepTreeRoot(rng, (uint32_t)pos, &keys[first + i], root.root))
+					return -1;
+				out[first + i] = RNG_MakeFloat64(RNG_RootWord, &root);
+			}
+			else
+			{
+				// the slot is patched in place, so a shared state gets its private copy first
+				if (RNG_UnshareState(rng))
+					return -1;
+				flat.state = RNG_StateData(rng);
+				memcpy(saved, &RNG_StateData(rng)[pos], sizeof(uint64_t));
+				memcpy(&RNG_StateData(rng)[pos], &keys[first + i], sizeof(uint64_t));
+				out[first + i] = RNG_MakeFloat64(RNG_FlatWord, &flat);
+				memcpy(&RNG_StateData(rng)[pos], saved, sizeof(uint64_t));
+			}
+		}
+	}
+
+	return 0;
 }
@@ -0,0 +1,318 @@
+/*
+	Runtime dispatch of the XXH3 long-input kernels, implementing the functions declared in
+	inc/xxh_x86dispatch.h.
+
+	The scalar, SSE2, AVX2 and AVX-512 accumulate/scramble kernels of xxhash.h are all compiled into this
+	file, each with the matching target attribute, and the best one the CPU and OS support is selected once
+	at load time. Inputs of up to XXH3_MIDSIZE_MAX bytes never reach the wide kernels, so they take the same
+	inline path as the non-dispatched functions. All outputs are bit-identical to the plain XXH3 functions.
+
+	Build this file together with rng.c and define RNG_X86DISPATCH for both to enable it.
+*/
+
+#if !(defined(__x86_64__) || defined(__i386__) || defined(_M_IX86) || defined(_M_X64))
+#error "xxh_x86dispatch.c only supports x86 and x86-64 targets"
+#endif
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+#define XXH_DISPATCH_AVX2	1
+#define XXH_DISPATCH_AVX512	1
+
+#if defined(__GNUC__)
+#define XXH_TARGET_SSE2		__attribute__((__target__("sse2")))
+#define XXH_TARGET_AVX2		__attribute__((__target__("avx2")))
+#define XXH_TARGET_AVX512	__attribute__((__target__("avx512f")))
+#else
+#define XXH_TARGET_SSE2
+#define XXH_TARGET_AVX2
+#define XXH_TARGET_AVX512
+#endif
+
+#define XXH_X86DISPATCH
+#define XXH_INLINE_ALL
+#include "../inc/xxhash.h"
+
+// the prototypes must see the same (inlined) type names as the definitions below, with external linkage
+#undef XXH_PUBLIC_API
+#define XXH_PUBLIC_API
+#define XXH_DISPATCH_DISABLE_REPLACE
+#include "../inc/xxh_x86dispatch.h"
+
+#define DISPATCH_SCALAR	0
+#define DISPATCH_SSE2	1
+#define DISPATCH_AVX2	2
+#define DISPATCH_AVX512	3
+
+#define CPUID1_EDX_SSE2		(1u << 26)
+#define CPUID1_ECX_OSXSAVE	(1u << 27)
+#define CPUID1_ECX_AVX		(1u << 28)
+#define CPUID7_EBX_AVX2		(1u << 5)
+#define CPUID7_EBX_AVX512F	(1u << 16)
+
+#define XCR0_SSE_AVX		0x06u	// XMM and YMM state
+#define XCR0_AVX512			0xE6u	// XMM, YMM, opmask, ZMM_Hi256 and Hi16_ZMM state
+
+static void Dispatch_CPUID(uint32_t leaf, uint32_t subleaf, uint32_t *abcd)
+{
+#if defined(_MSC_VER)
+	int regs[4];
+
+	__cpuidex(regs, (int)leaf, (int)subleaf);
+	abcd[0] = (uint32_t)regs[0];
+	abcd[1] = (uint32_t)regs[1];
+	abcd[2] = (uint32_t)regs[2];
+	abcd[3] = (uint32_t)regs[3];
+#else
+	unsigned int a = 0, b = 0, c = 0, d = 0;
+
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	abcd[0] = a;
+	abcd[1] = b;
+	abcd[2] = c;
+	abcd[3] = d;
+#endif
+}
+
+static uint64_t Dispatch_XGETBV(void)
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static int Dispatch_DetectLevel(void)
+{
+	uint32_t abcd[4];
+	uint32_t max_leaf;
+	uint32_t ecx1;
+	uint32_t ebx7;
+	uint64_t xcr0;
+
+	Dispatch_CPUID(0, 0, abcd);
+	max_leaf = abcd[0];
+
+	Dispatch_CPUID(1, 0, abcd);
+	ecx1 = abcd[2];
+	if (!(abcd[3] & CPUID1_EDX_SSE2))
+		return DISPATCH_SCALAR;
+
+	// AVX state must be enabled by the OS, not just supported by the CPU
+	if ((max_leaf < 7) || !(ecx1 & CPUID1_ECX_OSXSAVE) || !(ecx1 & CPUID1_ECX_AVX))
+		return DISPATCH_SSE2;
+
+	xcr0 = Dispatch_XGETBV();
+	if ((xcr0 & XCR0_SSE_AVX) != XCR0_SSE_AVX)
+		return DISPATCH_SSE2;
+
+	Dispatch_CPUID(7, 0, abcd);
+	ebx7 = abcd[1];
+	if (!(ebx7 & CPUID7_EBX_AVX2))
+		return DISPATCH_SSE2;
+
+	if ((ebx7 & CPUID7_EBX_AVX512F) && ((xcr0 & XCR0_AVX512) == XCR0_AVX512))
+		return DISPATCH_AVX512;
+
+	return DISPATCH_AVX2;
+}
+
+// GCC does not always emit vzeroupper on leaving a target("avx...") function, and the dirty upper halves then
+// slow down every legacy SSE instruction the caller runs afterwards, so the wide kernels clear them explicitly
+#define DISPATCH_ZEROUPPER_scalar()
+#define DISPATCH_ZEROUPPER_sse2()
+#define DISPATCH_ZEROUPPER_avx2()		_mm256_zeroupper()
+#define DISPATCH_ZEROUPPER_avx512()		_mm256_zeroupper()
+
+#define DISPATCH_DEFINE_FUNCS(suffix, target)\
+XXH_NO_INLINE target XXH64_hash_t \
+XXHL64_default_##suffix(const void* XXH_RESTRICT input, size_t len)\
+{\
+	XXH64_hash_t h = XXH3_hashLong_64b_internal(input, len, XXH3_kSecret, sizeof(XXH3_kSecret),\
+		XXH3_accumulate_512_##suffix, XXH3_scrambleAcc_##suffix);\
+	DISPATCH_ZEROUPPER_##suffix();\
+	return h;\
+}\
+XXH_NO_INLINE target XXH64_hash_t \
+XXHL64_seed_##suffix(const void* XXH_RESTRICT input, size_t len, XXH64_hash_t seed)\
+{\
+	XXH64_hash_t h = XXH3_hashLong_64b_withSeed_internal(input, len, seed,\
+		XXH3_accumulate_512_##suffix, XXH3_scrambleAcc_##suffix, XXH3_initCustomSecret_##suffix);\
+	DISPATCH_ZEROUPPER_##suffix();\
+	return h;\
+}\
+XXH_NO_INLINE target XXH64_hash_t \
+XXHL64_secret_##suffix(const void* XXH_RESTRICT input, size_t len, const void* secret, size_t secretLen)\
+{\
+	XXH64_hash_t h = XXH3_hashLong_64b_internal(input, len, secret, secretLen,\
+		XXH3_accumulate_512_##suffix, XXH3_scrambleAcc_##suffix);\
+	DISPATCH_ZEROUPPER_##suffix();\
+	return h;\
+}\
+XXH_NO_INLINE target XXH_errorcode \
+XXH3_update_##suffix(XXH3_state_t* state, const void* input, size_t len)\
+{\
+	XXH_errorcode e = XXH3_update(state, (const xxh_u8*)input, len,\
+		XXH3_accumulate_512_##suffix, XXH3_scrambleAcc_##suffix);\
+	DISPATCH_ZEROUPPER_##suffix();\
+	return e;\
+}\
+XXH_NO_INLINE target XXH128_hash_t \
+XXHL128_default_##suffix(const void* XXH_RESTRICT input, size_t len)\
+{\
+	XXH128_hash_t h = XXH3_hashLong_128b_internal(input, len, XXH3_kSecret, sizeof(XXH3_kSecret),\
+		XXH3_accumulate_512_##suffix, XXH3_scrambleAcc_##suffix);\
+	DISPATCH_ZEROUPPER_##suffix();\
+	return h;\
+}\
+XXH_NO_INLINE target XXH128_hash_t \
+XXHL128_seed_##suffix(const void* XXH_RESTRICT input, size_t len, XXH64_hash_t seed)\
+{\
+	XXH128_hash_t h = XXH3_hashLong_128b_withSeed_internal(input, len, seed,\
+		XXH3_accumulate_512_##suffix, XXH3_scrambleAcc_##suffix, XXH3_initCustomSecret_##suffix);\
+	DISPATCH_ZEROUPPER_##suffix();\
+	return h;\
+}\
+XXH_NO_INLINE target XXH128_hash_t \
+XXHL128_secret_##suffix(const void* XXH_RESTRICT input, size_t len, const void* secret, size_t secretLen)\
+{\
+	XXH128_hash_t h = XXH3_hashLong_128b_internal(input, len, (const xxh_u8*)secret, secretLen,\
+		XXH3_accumulate_512_##suffix, XXH3_scrambleAcc_##suffix);\
+	DISPATCH_ZEROUPPER_##suffix();\
+	return h;\
+}
+
+DISPATCH_DEFINE_FUNCS(scalar, /* nothing */)
+DISPATCH_DEFINE_FUNCS(sse2, XXH_TARGET_SSE2)
+DISPATCH_DEFINE_FUNCS(avx2, XXH_TARGET_AVX2)
+DISPATCH_DEFINE_FUNCS(avx512, XXH_TARGET_AVX512)
+
+#undef DISPATCH_DEFINE_FUNCS
+
+typedef XXH64_hash_t (*dispatch_long64_default_t)(const void* XXH_RESTRICT, size_t);
+typedef XXH64_hash_t (*dispatch_long64_seed_t)(const void* XXH_RESTRICT, size_t, XXH64_hash_t);
+typedef XXH64_hash_t (*dispatch_long64_secret_t)(const void* XXH_RESTRICT, size_t, const void*, size_t);
+typedef XXH_errorcode (*dispatch_update_t)(XXH3_state_t*, const void*, size_t);
+typedef XXH128_hash_t (*dispatch_long128_default_t)(const void* XXH_RESTRICT, size_t);
+typedef XXH128_hash_t (*dispatch_long128_seed_t)(const void* XXH_RESTRICT, size_t, XXH64_hash_t);
+typedef XXH128_hash_t (*dispatch_long128_secret_t)(const void* XXH_RESTRICT, size_t, const void*, size_t);
+
+typedef struct dispatch_table_s
+{
+	dispatch_long64_default_t	long64_default;
+	dispatch_long64_seed_t		long64_seed;
+	dispatch_long64_secret_t	long64_secret;
+	dispatch_update_t			update;
+	dispatch_long128_default_t	long128_default;
+	dispatch_long128_seed_t		long128_seed;
+	dispatch_long128_secret_t	long128_secret;
+}dispatch_table_t;
+
+static const dispatch_table_t g_dispatch_tables[4] =
+{
+	{XXHL64_default_scalar, XXHL64_seed_scalar, XXHL64_secret_scalar, XXH3_update_scalar, XXHL128_default_scalar, XXHL128_seed_scalar, XXHL128_secret_scalar},
+	{XXHL64_default_sse2, XXHL64_seed_sse2, XXHL64_secret_sse2, XXH3_update_sse2, XXHL128_default_sse2, XXHL128_seed_sse2, XXHL128_secret_sse2},
+	{XXHL64_default_avx2, XXHL64_seed_avx2, XXHL64_secret_avx2, XXH3_update_avx2, XXHL128_default_avx2, XXHL128_seed_avx2, XXHL128_secret_avx2},
+	{XXHL64_default_avx512, XXHL64_seed_avx512, XXHL64_secret_avx512, XXH3_update_avx512, XXHL128_default_avx512, XXHL128_seed_avx512, XXHL128_secret_avx512}
+};
+
+// Selected once; every thread that races here stores the same pointer, so no locking is needed.
+static const dispatch_table_t *volatile g_dispatch = 0;
+
+static const dispatch_table_t *Dispatch_Table(void)
+{
+	const dispatch_table_t *table = g_dispatch;
+
+	if (!table)
+	{
+		table = &g_dispatch_tables[Dispatch_DetectLevel()];
+		g_dispatch = table;
+	}
+
+	return table;
+}
+
+#if defined(__GNUC__)
+__attribute__((constructor)) static void Dispatch_Init(void)
+{
+	Dispatch_Table();
+}
+#endif
+
+// adapters from the hashLong signatures used by XXH3_*_internal to the dispatched kernels
+static XXH64_hash_t XXH3_hashLong_64b_defaultFromDispatch(const void* XXH_RESTRICT input, size_t len, XXH64_hash_t seed64, const xxh_u8* XXH_RESTRICT secret, size_t secretLen)
+{
+	(void)seed64; (void)secret; (void)secretLen;
+	return Dispatch_Table()->long64_default(input, len);
+}
+static XXH64_hash_t XXH3_hashLong_64b_withSeedFromDispatch(const void* XXH_RESTRICT input, size_t len, XXH64_hash_t seed64, const xxh_u8* XXH_RESTRICT secret, size_t secretLen)
+{
+	(void)secret; (void)secretLen;
+	return Dispatch_Table()->long64_seed(input, len, seed64);
+}
+static XXH64_hash_t XXH3_hashLong_64b_withSecretFromDispatch(const void* XXH_RESTRICT input, size_t len, XXH64_hash_t seed64, const xxh_u8* XXH_RESTRICT secret, size_t secretLen)
+{
+	(void)seed64;
+	return Dispatch_Table()->long64_secret(input, len, secret, secretLen);
+}
+static XXH128_hash_t XXH3_hashLong_128b_defaultFromDispatch(const void* XXH_RESTRICT input, size_t len, XXH64_hash_t seed64, const void* XXH_RESTRICT secret, size_t secretLen)
+{
+	(void)seed64; (void)secret; (void)secretLen;
+	return Dispatch_Table()->long128_default(input, len);
+}
+static XXH128_hash_t XXH3_hashLong_128b_withSeedFromDispatch(const void* XXH_RESTRICT input, size_t len, XXH64_hash_t seed64, const void* XXH_RESTRICT secret, size_t secretLen)
+{
+	(void)secret; (void)secretLen;
+	return Dispatch_Table()->long128_seed(input, len, seed64);
+}
+static XXH128_hash_t XXH3_hashLong_128b_withSecretFromDispatch(const void* XXH_RESTRICT input, size_t len, XXH64_hash_t seed64, const void* XXH_RESTRICT secret, size_t secretLen)
+{
+	(void)seed64;
+	return Dispatch_Table()->long128_secret(input, len, secret, secretLen);
+}
+
+XXH64_hash_t XXH3_64bits_dispatch(const void* input, size_t len)
+{
+	return XXH3_64bits_internal(input, len, 0, XXH3_kSecret, sizeof(XXH3_kSecret), XXH3_hashLong_64b_defaultFromDispatch);
+}
+XXH64_hash_t XXH3_64bits_withSeed_dispatch(const void* input, size_t len, XXH64_hash_t seed)
+{
+	return XXH3_64bits_internal(input, len, seed, XXH3_kSecret, sizeof(XXH3_kSecret), XXH3_hashLong_64b_withSeedFromDispatch);
+}
+XXH64_hash_t XXH3_64bits_withSecret_dispatch(const void* input, size_t len, const void* secret, size_t secretLen)
+{
+	return XXH3_64bits_internal(input, len, 0, secret, secretLen, XXH3_hashLong_64b_withSecretFromDispatch);
+}
+XXH_errorcode XXH3_64bits_update_dispatch(XXH3_state_t* state, const void* input, size_t len)
+{
+	return Dispatch_Table()->update(state, input, len);
+}
+
+XXH128_hash_t XXH3_128bits_dispatch(const void* input, size_t len)
+{
+	return XXH3_128bits_internal(input, len, 0, XXH3_kSecret, sizeof(XXH3_kSecret), XXH3_hashLong_128b_defaultFromDispatch);
+}
+XXH128_hash_t XXH3_128bits_withSeed_dispatch(const void* input, size_t len, XXH64_hash_t seed)
+{
+	return XXH3_128bits_internal(input, len, seed, XXH3_kSecret, sizeof(XXH3_kSecret), XXH3_hashLong_128b_withSeedFromDispatch);
+}
+XXH128_hash_t XXH3_128bits_withSecret_dispatch(const void* input, size_t len, const void* secret, size_t secretLen)
+{
+	return XXH3_128bits_internal(input, len, 0, secret, secretLen, XXH3_hashLong_128b_withSecretFromDispatch);
+}
+XXH_errorcode XXH3_128bits_update_dispatch(XXH3_state_t* state, const void* input, size_t len)
+{
+	return Dispatch_Table()->update(state, input, len);
+}
@@ -0,0 +1,100 @@
+/*
+	Stress test of RNG_InternIDString and RNG_ReleaseID from two threads.
+
+	Both threads intern and release the same few strings in the same order, so that the count of a record
+	keeps dropping to zero while the other thread is looking it up. Every returned record is attached to an
+	RNG and read back with RNG_CopyID, which fails if a thread was handed a record that is being freed. The
+	RNG is then given its own record again, which must not release the record before taking it back.
+	Build it with -fsanitize=address (or thread) to catch the use after free itself. The race needs at
+	least two CPUs to show up in a reasonable number of iterations.
+
+	Build (see the README):
+		cc -std=c11 -O2 -c src/rng.c -o rng.o
+		c++ -std=c++11 -O2 test/rng_intern_stress.cpp rng.o -o rng_intern_stress -lpthread
+
+	Usage: rng_intern_stress [--iterations n]
+	Exits with 0 if every record matched its string.
+*/
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "../inc/rng.h"
+
+namespace
+{
+
+const char *const g_keys[] = { "alpha", "beta", "gamma" };
+const unsigned g_key_count = sizeof(g_keys) / sizeof(g_keys[0]);
+
+std::atomic<unsigned> g_failures(0);
+std::atomic<unsigned> g_started(0);
+
+void StressThread(unsigned iterations)
+{
+	char buffer[16];
+	unsigned i;
+
+	g_started.fetch_add(1);
+	while (g_started.load() < 2)
+		std::this_thread::yield();
+
+	for (i = 0; i < iterations; i++)
+	{
+		const char *key = g_keys[i % g_key_count];
+		rng_id_t *id = RNG_InternIDString(key);
+		rng_t rng;
+
+		if (!id)
+		{
+			g_failures.fetch_add(1);
+			continue;
+		}
+		if ((i & 1) == 0)
+		{
+			RNG_ReleaseID(id); // the fastest way to drop the count to zero under the other thread
+			continue;
+		}
+
+		rng = RNG_New();
+		if (RNG_SetIDInterned(&rng, id))
+			g_failures.fetch_add(1);
+		RNG_ReleaseID(id);
+		if (RNG_CopyID(&rng, buffer) || strcmp(buffer, key))
+			g_failures.fetch_add(1);
+		// the RNG holds the only reference it asks for, and setting it again must not free it first
+		if (RNG_SetIDInterned(&rng, rng.id_record) || RNG_CopyID(&rng, buffer) || strcmp(buffer, key))
+			g_failures.fetch_add(1);
+		RNG_Destroy(&rng);
+	}
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	unsigned iterations = 20000000;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+			iterations = (unsigned)strtoul(argv[++i], 0, 10);
+		else
+		{
+			fprintf(stderr, "usage: %s [--iterations n]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	std::thread a(StressThread, iterations);
+	std::thread b(StressThread, iterations);
+	a.join();
+	b.join();
+
+	printf("{\"iterations\": %u, \"threads\": 2, \"failures\": %u}\n", iterations, g_failures.load());
+
+	return g_failures.load() ? 1 : 0;
+}